@@ -0,0 +1,406 @@
+// Microbenchmarks of the parts of an iteration and of the server's grid
+// handling, over several grid sizes and densities. Results are written as JSON
+// so that runs of different revisions can be compared.
+//
+// With --scaling it instead runs whole iterations over a matrix of grid sizes,
+// species densities, tick modes and worker counts, and writes one CSV row per
+// point.
+#include "grid_binary.h"
+#include "grid_json.h"
+#include "simulation.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Occupied fraction of the grid for each species
+struct species_mix_t
+{
+    double plants;
+    double herbivores;
+    double carnivores;
+
+    double total() const { return plants + herbivores + carnivores; }
+};
+
+// Split of an occupied fraction like the web page's defaults: 60% plants, 30%
+// herbivores, 10% carnivores
+static species_mix_t default_mix(double density) {
+    return {density * 0.6, density * 0.3, density * 0.1};
+}
+
+struct bench_options_t
+{
+    bool scaling = false;
+    std::vector<uint32_t> sizes; // defaults depend on the benchmark
+    std::vector<double> densities = {0.1, 0.3, 0.6};
+    // Per-species densities; when any is given, the benchmarks sweep every
+    // combination of them instead of densities (a missing list takes its share
+    // of the default split of 0.3)
+    std::vector<double> plant_densities;
+    std::vector<double> herbivore_densities;
+    std::vector<double> carnivore_densities;
+    std::vector<tick_mode_t> modes = {tick_in_place, tick_checkerboard, tick_strips, tick_double_buffered};
+    std::vector<uint32_t> worker_counts;
+    double min_seconds = 0.2; // each measurement repeats its body for at least this long
+    const char *output_path = nullptr;
+};
+
+// Runs body until min_seconds have passed and returns the mean time of one run.
+// body returns a value that is accumulated so the work can't be optimized away.
+static double time_per_run(double min_seconds, uint64_t &runs, const std::function<uint64_t()> &body) {
+    uint64_t checksum = 0;
+    runs = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        checksum += body();
+        runs++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    // An empty asm that claims to read the checksum keeps it, and so the work, alive
+    asm volatile("" : : "r"(checksum));
+    return elapsed / runs;
+}
+
+// The species mixes to benchmark, skipping those that don't fit in the grid
+static std::vector<species_mix_t> species_mixes(const bench_options_t &options) {
+    std::vector<species_mix_t> mixes;
+    if (options.plant_densities.empty() && options.herbivore_densities.empty() && options.carnivore_densities.empty()) {
+        for (double density : options.densities) {
+            mixes.push_back(default_mix(density));
+        }
+        return mixes;
+    }
+
+    species_mix_t fallback = default_mix(0.3);
+    auto or_default = [](const std::vector<double> &values, double value) { return values.empty() ? std::vector<double>{value} : values; };
+    for (double plants : or_default(options.plant_densities, fallback.plants)) {
+        for (double herbivores : or_default(options.herbivore_densities, fallback.herbivores)) {
+            for (double carnivores : or_default(options.carnivore_densities, fallback.carnivores)) {
+                species_mix_t mix = {plants, herbivores, carnivores};
+                if (mix.total() > 1) {
+                    fprintf(stderr, "skipping densities %g,%g,%g: more than the whole grid\n", plants, herbivores, carnivores);
+                    continue;
+                }
+                mixes.push_back(mix);
+            }
+        }
+    }
+    return mixes;
+}
+
+// Initial populations for the given species densities
+static simulation_config_t bench_config(uint32_t size, const species_mix_t &mix, uint64_t seed) {
+    simulation_config_t config;
+    config.rows = size;
+    config.cols = size;
+    config.seed = seed;
+    uint64_t cells = (uint64_t)size * size;
+    config.plants = (uint64_t)(mix.plants * cells);
+    config.herbivores = (uint64_t)(mix.herbivores * cells);
+    config.carnivores = std::min<uint64_t>((uint64_t)(mix.carnivores * cells), cells - config.plants - config.herbivores);
+    return config;
+}
+
+static std::vector<std::string> split_list(const std::string &list) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        items.push_back(list.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+static bool parse_list(const char *text, std::vector<double> &values) {
+    values.clear();
+    for (const std::string &item : split_list(text)) {
+        char *item_end;
+        double value = std::strtod(item.c_str(), &item_end);
+        if (item.empty() || *item_end != '\0' || value < 0) {
+            return false;
+        }
+        values.push_back(value);
+    }
+    return true;
+}
+
+static void run_microbenchmarks(const bench_options_t &options, FILE *output) {
+    nlohmann::json results = nlohmann::json::array();
+    auto report = [&](const char *name, uint32_t size, const species_mix_t &mix, double seconds, uint64_t runs, uint64_t items) {
+        results.push_back({{"benchmark", name},
+                           {"rows", size},
+                           {"cols", size},
+                           {"density", mix.total()},
+                           {"plant_density", mix.plants},
+                           {"herbivore_density", mix.herbivores},
+                           {"carnivore_density", mix.carnivores},
+                           {"runs", runs},
+                           {"seconds_per_run", seconds},
+                           {"items_per_run", items},
+                           {"ns_per_item", items > 0 ? seconds * 1e9 / items : 0.0}});
+        fprintf(stderr, "%-16s %5ux%-5u densities %.2f/%.2f/%.2f: %12.1f ns/item\n", name, size, size, mix.plants,
+                mix.herbivores, mix.carnivores, items > 0 ? seconds * 1e9 / items : 0.0);
+    };
+
+    std::vector<species_mix_t> mixes = species_mixes(options);
+    for (uint32_t size : options.sizes) {
+        for (const species_mix_t &mix : mixes) {
+            simulation_config_t config = bench_config(size, mix, 1);
+            uint64_t entities = (uint64_t)config.plants + config.herbivores + config.carnivores;
+            uint64_t runs;
+
+            // Random placement of the initial populations, as in /start-simulation
+            uint64_t seed = 1;
+            double seconds = time_per_run(options.min_seconds, runs, [&]() {
+                config.seed = seed++;
+                start_simulation(config);
+                return (uint64_t)population(plant);
+            });
+            report("placement", size, mix, seconds, runs, entities);
+
+            // The rest work on one fixed placement
+            config.seed = 1;
+            start_simulation(config);
+
+            seconds = time_per_run(options.min_seconds, runs, [] { return scan_live_neighbourhoods(); });
+            report("neighbour_scan", size, mix, seconds, runs, entities);
+
+            seconds = time_per_run(options.min_seconds, runs, [&] { return draw_random_actions(entities); });
+            report("random_action", size, mix, seconds, runs, entities);
+
+            seconds = time_per_run(options.min_seconds, runs, [] {
+                nlohmann::json json_grid = entity_grid;
+                return (uint64_t)json_grid.dump().size();
+            });
+            report("json_serialize", size, mix, seconds, runs, (uint64_t)size * size);
+
+            seconds = time_per_run(options.min_seconds, runs, [] { return (uint64_t)grid_to_binary(entity_grid, 0, 0).size(); });
+            report("binary_serialize", size, mix, seconds, runs, (uint64_t)size * size);
+        }
+    }
+
+    fprintf(output, "%s\n", results.dump(2).c_str());
+}
+
+// Throughput of one point of the scaling matrix
+struct scaling_result_t
+{
+    uint64_t ticks;
+    double seconds;
+    double mean_live; // live entities per iteration, averaged over the timed ones
+};
+
+// Runs iterations of one configuration for at least min_seconds (and at least 3
+// iterations), after one untimed warm-up iteration
+static scaling_result_t measure_scaling_point(const simulation_config_t &config, uint32_t num_workers, double min_seconds) {
+    worker_pool workers(num_workers);
+    start_simulation(config);
+    next_iteration(workers);
+
+    scaling_result_t result = {0, 0, 0};
+    double live_sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (result.ticks < 3 || result.seconds < min_seconds) {
+        live_sum += population(plant) + population(herbivore) + population(carnivore);
+        next_iteration(workers);
+        result.ticks++;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    result.mean_live = live_sum / result.ticks;
+    return result;
+}
+
+// Every point runs in a child process, so the peak RSS that wait4 reports for
+// the child belongs to that point alone
+static void run_scaling(const bench_options_t &options, FILE *output) {
+    fprintf(output, "rows,cols,density,plant_density,herbivore_density,carnivore_density,mode,workers,ticks,seconds,ticks_per_second,ns_per_live_entity,mean_live_entities,peak_rss_kb\n");
+    fflush(output);
+
+    std::vector<species_mix_t> mixes = species_mixes(options);
+    for (uint32_t size : options.sizes) {
+        for (const species_mix_t &mix : mixes) {
+            double density = mix.total();
+            for (tick_mode_t mode : options.modes) {
+                for (uint32_t num_workers : options.worker_counts) {
+                    simulation_config_t config = bench_config(size, mix, 1);
+                    config.mode = mode;
+
+                    int channel[2];
+                    if (pipe(channel) != 0) {
+                        perror("pipe");
+                        return;
+                    }
+                    fflush(nullptr);
+                    pid_t child = fork();
+                    if (child == 0) {
+                        close(channel[0]);
+                        scaling_result_t result = measure_scaling_point(config, num_workers, options.min_seconds);
+                        ssize_t written = write(channel[1], &result, sizeof(result));
+                        _exit(written == sizeof(result) ? 0 : 1);
+                    }
+                    close(channel[1]);
+
+                    scaling_result_t result;
+                    bool received = child > 0 && read(channel[0], &result, sizeof(result)) == sizeof(result);
+                    close(channel[0]);
+                    int status = 0;
+                    struct rusage usage = {};
+                    if (child > 0) {
+                        wait4(child, &status, 0, &usage);
+                    }
+                    if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                        fprintf(stderr, "%ux%u densities %.2f/%.2f/%.2f %s %u workers: failed\n", size, size, mix.plants,
+                                mix.herbivores, mix.carnivores, TICK_MODE_NAMES[mode].first, num_workers);
+                        continue;
+                    }
+
+                    double ticks_per_second = result.ticks / result.seconds;
+                    double ns_per_entity = result.mean_live > 0 ? result.seconds * 1e9 / result.ticks / result.mean_live : 0.0;
+                    fprintf(output, "%u,%u,%g,%g,%g,%g,%s,%u,%llu,%.6f,%.3f,%.3f,%.1f,%ld\n", size, size, density, mix.plants,
+                            mix.herbivores, mix.carnivores, TICK_MODE_NAMES[mode].first,
+                            num_workers, (unsigned long long)result.ticks, result.seconds, ticks_per_second, ns_per_entity,
+                            result.mean_live, usage.ru_maxrss);
+                    fflush(output);
+                    fprintf(stderr, "%5ux%-5u densities %.2f/%.2f/%.2f %-15s %3u workers: %10.2f ticks/s %10.1f ns/entity\n", size,
+                            size, mix.plants, mix.herbivores, mix.carnivores, TICK_MODE_NAMES[mode].first, num_workers, ticks_per_second, ns_per_entity);
+                }
+            }
+        }
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --scaling            run the scaling matrix instead of the microbenchmarks\n"
+            "  --sizes A,B,...      side of the square grids (default 64,256,1024;\n"
+            "                       15,100,1000,10000 with --scaling)\n"
+            "  --densities A,B,...  occupied fraction of the cells, split 60/30/10 between\n"
+            "                       plants, herbivores and carnivores (default 0.1,0.3,0.6)\n"
+            "  --plants A,B,...     fraction of the cells with plants; with --herbivores and\n"
+            "  --herbivores A,B,... --carnivores, sweeps every combination instead of\n"
+            "  --carnivores A,B,... --densities (a missing list defaults to 0.18, 0.09 or 0.03)\n"
+            "  --modes A,B,...      tick modes of the scaling matrix (default all)\n"
+            "  --workers A,B,...    worker counts of the scaling matrix (default 1, 2, 4... up to the cores)\n"
+            "  --min-time S         minimum seconds per measurement (default 0.2)\n"
+            "  --output FILE        write the results to FILE instead of stdout (JSON, or CSV with --scaling)\n",
+            program);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t options;
+    for (int k = 1; k < argc; k++) {
+        std::string option = argv[k];
+        if (option == "--help" || option == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (option == "--scaling") {
+            options.scaling = true;
+            continue;
+        }
+        if (k + 1 == argc) {
+            fprintf(stderr, "missing value for %s\n", option.c_str());
+            return 2;
+        }
+        const char *value = argv[++k];
+
+        std::vector<double> values;
+        bool valid = true;
+        if (option == "--sizes" || option == "--densities" || option == "--plants" || option == "--herbivores" ||
+            option == "--carnivores" || option == "--workers" || option == "--min-time") {
+            valid = parse_list(value, values);
+        }
+
+        if (option == "--sizes") {
+            options.sizes.clear();
+            for (double size : values) {
+                valid = valid && size >= 1 && size * size <= MAXIMUM_NUM_CELLS;
+                options.sizes.push_back(size);
+            }
+        }
+        else if (option == "--densities") {
+            for (double density : values) {
+                valid = valid && density <= 1;
+            }
+            options.densities = values;
+        }
+        else if (option == "--plants" || option == "--herbivores" || option == "--carnivores") {
+            for (double density : values) {
+                valid = valid && density <= 1;
+            }
+            (option == "--plants" ? options.plant_densities : option == "--herbivores" ? options.herbivore_densities : options.carnivore_densities) = values;
+        }
+        else if (option == "--workers") {
+            options.worker_counts.clear();
+            for (double count : values) {
+                valid = valid && count >= 1;
+                options.worker_counts.push_back(count);
+            }
+        }
+        else if (option == "--modes") {
+            options.modes.clear();
+            for (const std::string &name : split_list(value)) {
+                tick_mode_t mode;
+                valid = valid && parse_tick_mode(name, mode);
+                options.modes.push_back(mode);
+            }
+        }
+        else if (option == "--min-time") {
+            valid = valid && values.size() == 1;
+            options.min_seconds = values.empty() ? 0 : values[0];
+        }
+        else if (option == "--output") {
+            options.output_path = value;
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", option.c_str());
+            usage(argv[0]);
+            return 2;
+        }
+        if (!valid) {
+            fprintf(stderr, "invalid value for %s: %s\n", option.c_str(), value);
+            return 2;
+        }
+    }
+
+    if (options.sizes.empty()) {
+        options.sizes = options.scaling ? std::vector<uint32_t>{15, 100, 1000, 10000} : std::vector<uint32_t>{64, 256, 1024};
+    }
+    if (options.worker_counts.empty()) {
+        uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (uint32_t count = 1; count < cores; count *= 2) {
+            options.worker_counts.push_back(count);
+        }
+        options.worker_counts.push_back(cores);
+    }
+
+    FILE *output = stdout;
+    if (options.output_path != nullptr && (output = fopen(options.output_path, "w")) == nullptr) {
+        perror(options.output_path);
+        return 1;
+    }
+    if (options.scaling) {
+        run_scaling(options, output);
+    }
+    else {
+        run_microbenchmarks(options, output);
+    }
+    if (output != stdout) {
+        fclose(output);
+    }
+    return 0;
+}
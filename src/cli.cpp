@@ -0,0 +1,194 @@
+// Headless driver of the simulation: runs a number of iterations as fast as the
+// engine allows and writes the population counts as CSV, with no HTTP or JSON
+// in the loop.
+#include "simulation.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --rows N          grid rows (default %u)\n"
+            "  --cols N          grid columns (default %u)\n"
+            "  --plants N        initial plants\n"
+            "  --herbivores N    initial herbivores\n"
+            "  --carnivores N    initial carnivores\n"
+            "  --mode NAME       in_place, checkerboard, strips or double_buffered\n"
+            "                    (default in_place, or checkerboard when --seed is given)\n"
+            "  --seed N          seed of the random draws (default: random)\n"
+            "  --ticks N         iterations to run, at most with the options below (default 1000)\n"
+            "  --until-extinction  stop as soon as a species dies out\n"
+            "  --steady-epsilon E  with --steady-ticks, stop once the total population stays\n"
+            "  --steady-ticks K      within a fraction E of its value for K ticks in a row\n"
+            "  --max-seconds S     stop after S seconds of wall-clock time\n"
+            "  --workers N       worker threads (default: one per core)\n"
+            "  --every N         write a CSV row every N iterations (default 1)\n"
+            "  --output FILE     write the CSV to FILE instead of stdout\n",
+            program, DEFAULT_NUM_ROWS, DEFAULT_NUM_COLS);
+}
+
+// Parses an unsigned decimal argument, rejecting trailing garbage
+static bool parse_number(const char *text, uint64_t &value) {
+    char *end;
+    value = std::strtoull(text, &end, 10);
+    return *text != '\0' && *text != '-' && *end == '\0';
+}
+
+static bool parse_fraction(const char *text, double &value) {
+    char *end;
+    value = std::strtod(text, &end);
+    return *text != '\0' && *end == '\0' && value >= 0;
+}
+
+int main(int argc, char *argv[])
+{
+    simulation_config_t config;
+    config.seed = ((uint64_t)std::random_device()() << 32) | std::random_device()();
+    uint64_t ticks = 1000;
+    uint64_t num_workers = std::thread::hardware_concurrency();
+    uint64_t every = 1;
+    const char *output_path = nullptr;
+    stop_conditions_t conditions;
+    conditions.extinction = false;
+    bool mode_given = false;
+    bool seed_given = false;
+
+    for (int k = 1; k < argc; k++) {
+        std::string option = argv[k];
+        if (option == "--help" || option == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (option == "--until-extinction") {
+            conditions.extinction = true;
+            continue;
+        }
+        if (k + 1 == argc) {
+            fprintf(stderr, "missing value for %s\n", option.c_str());
+            usage(argv[0]);
+            return 2;
+        }
+        const char *value = argv[++k];
+
+        uint64_t number = 0;
+        bool valid = true;
+        if (option == "--mode") {
+            valid = parse_tick_mode(value, config.mode);
+            mode_given = true;
+        }
+        else if (option == "--output") {
+            output_path = value;
+        }
+        else if (option == "--steady-epsilon") {
+            valid = parse_fraction(value, conditions.steady_epsilon);
+        }
+        else if (option == "--max-seconds") {
+            valid = parse_fraction(value, conditions.max_seconds);
+        }
+        else if (!parse_number(value, number)) {
+            valid = false;
+        }
+        else if (option == "--rows" || option == "--cols" || option == "--plants" || option == "--herbivores" || option == "--carnivores") {
+            valid = number <= MAXIMUM_NUM_CELLS;
+            uint32_t &field = option == "--rows" ? config.rows : option == "--cols" ? config.cols
+                            : option == "--plants" ? config.plants : option == "--herbivores" ? config.herbivores : config.carnivores;
+            field = number;
+        }
+        else if (option == "--seed") {
+            config.seed = number;
+            seed_given = true;
+        }
+        else if (option == "--ticks") {
+            ticks = number;
+        }
+        else if (option == "--steady-ticks") {
+            valid = number <= UINT32_MAX;
+            conditions.steady_ticks = number;
+        }
+        else if (option == "--workers") {
+            num_workers = number;
+        }
+        else if (option == "--every") {
+            valid = number > 0;
+            every = number;
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", option.c_str());
+            usage(argv[0]);
+            return 2;
+        }
+
+        if (!valid) {
+            fprintf(stderr, "invalid value for %s: %s\n", option.c_str(), value);
+            return 2;
+        }
+    }
+
+    if (config.rows == 0 || config.cols == 0 || (uint64_t)config.rows * config.cols > MAXIMUM_NUM_CELLS) {
+        fprintf(stderr, "invalid grid dimensions\n");
+        return 2;
+    }
+    if ((uint64_t)config.plants + config.herbivores + config.carnivores > (uint64_t)config.rows * config.cols) {
+        fprintf(stderr, "too many entities\n");
+        return 2;
+    }
+
+    FILE *output = stdout;
+    if (output_path != nullptr && (output = fopen(output_path, "w")) == nullptr) {
+        perror(output_path);
+        return 1;
+    }
+
+    worker_pool workers(std::max<uint64_t>(1, num_workers));
+    if (seed_given && !mode_given) {
+        config.mode = SEEDED_TICK_MODE;
+    }
+    else if (seed_given && !tick_mode_is_deterministic(config.mode) && workers.size() > 1) {
+        fprintf(stderr, "warning: mode %s with %zu workers doesn't reproduce the seed exactly, use checkerboard or double_buffered\n",
+                TICK_MODE_NAMES[config.mode].first, workers.size());
+    }
+    start_simulation(config);
+    fprintf(stderr, "seed %llu, mode %s, %zu workers\n", (unsigned long long)config.seed, TICK_MODE_NAMES[config.mode].first, workers.size());
+
+    // elapsed_seconds only counts the time spent inside next_iteration
+    fprintf(output, "tick,plants,herbivores,carnivores,elapsed_seconds\n");
+    fprintf(output, "0,%u,%u,%u,0\n", population(plant), population(herbivore), population(carnivore));
+
+    conditions.max_ticks = ticks;
+    run_monitor_t monitor(conditions);
+    stop_reason_t reason = ticks == 0 ? stop_max_ticks : stop_none;
+
+    std::chrono::steady_clock::duration elapsed{0};
+    while (reason == stop_none) {
+        auto start = std::chrono::steady_clock::now();
+        next_iteration(workers);
+        elapsed += std::chrono::steady_clock::now() - start;
+        reason = monitor.observe();
+
+        if (monitor.ticks % every == 0 || reason != stop_none) {
+            fprintf(output, "%llu,%u,%u,%u,%.6f\n", (unsigned long long)monitor.ticks, population(plant), population(herbivore),
+                    population(carnivore), std::chrono::duration<double>(elapsed).count());
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    fprintf(stderr, "stopped by %s at tick %llu\n", stop_reason_name(reason), (unsigned long long)monitor.ticks);
+    fprintf(stderr, "%llu ticks in %.3f s (%.1f ticks/s)\n", (unsigned long long)monitor.ticks, seconds,
+            seconds > 0 ? monitor.ticks / seconds : 0.0);
+    const std::pair<entity_type_t, const char *> species[] = {{plant, "plants"}, {herbivore, "herbivores"}, {carnivore, "carnivores"}};
+    for (const auto &entry : species) {
+        const species_summary_t &summary = monitor.species[entry.first];
+        fprintf(stderr, "%s: final %u, min %u, max %u, mean %.1f\n", entry.second, population(entry.first), summary.minimum,
+                summary.maximum, monitor.ticks > 0 ? (double)summary.sum / monitor.ticks : 0.0);
+    }
+
+    if (output != stdout) {
+        fclose(output);
+    }
+    return 0;
+}
@@ -3817,6 +3817,26 @@ namespace crow
                 adaptor_.get_io_service().post(handler);
             }
 
+            /// Set a function called whenever every message sent so far has been written to the socket.
+
+            ///
+            /// Runs on the connection's thread, so it can be used to pace the messages to a slow peer.
+            void drain_handler(std::function<void()> handler)
+            {
+                drain_handler_ = std::move(handler);
+            }
+
+            /// Shut the socket down without waiting for the pending messages to be written.
+
+            ///
+            /// Drops a peer that stopped reading; the close handler runs as the pending operations fail.
+            void shutdown()
+            {
+                dispatch([this] {
+                    adaptor_.shutdown_readwrite();
+                });
+            }
+
             /// Send a "Ping" message.
 
             ///
@@ -4282,6 +4302,8 @@ namespace crow
                           {
                               if (!write_buffers_.empty())
                                   do_write();
+                              else if (drain_handler_)
+                                  drain_handler_();
                               if (has_sent_close_)
                                   close_connection_ = true;
                           }
@@ -4334,6 +4356,7 @@ namespace crow
             std::function<void(crow::websocket::connection&, const std::string&)> close_handler_;
             std::function<void(crow::websocket::connection&)> error_handler_;
             std::function<bool(const crow::request&)> accept_handler_;
+            std::function<void()> drain_handler_;
         };
     } // namespace websocket
 } // namespace crow
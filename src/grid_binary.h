@@ -0,0 +1,122 @@
+#ifndef ECOSIM_GRID_BINARY_H
+#define ECOSIM_GRID_BINARY_H
+
+#include "simulation.h"
+#include <cstring>
+#include <string>
+
+// Packed binary encoding of the grid, an alternative to the JSON array of cell
+// objects. All fields are little-endian. Every frame starts with
+//
+//   offset  size  field
+//        0     4  magic "ECOF"
+//        4     2  version (2)
+//        6     2  flags (GRID_FRAME_DELTA or 0)
+//        8     4  rows
+//       12     4  cols
+//       16     8  tick
+//       24     4  run (see simulation_run)
+//       28     4  base tick of a delta frame, equal to tick in a full frame
+//
+// A full frame follows with the columns of all n = rows * cols cells, row-major:
+//
+//       32     n  type (0 empty, 1 plant, 2 herbivore, 3 carnivore), padded with
+//                 a zero byte when n is odd
+//        …    2n  energy, int16
+//        …    2n  age, int16
+//
+// A delta frame follows with the m cells that may have changed since the base
+// tick, in ascending index order; every other cell is as it was at base tick:
+//
+//       32     4  m
+//       36    4m  index, uint32
+//        …     m  type, padded with a zero byte when m is odd
+//        …    2m  energy, int16
+//        …    2m  age, int16
+//
+// The padding keeps every column aligned to the size of its values, so a
+// browser can view them with typed arrays without copying.
+const char GRID_FRAME_MAGIC[4] = {'E', 'C', 'O', 'F'};
+const uint16_t GRID_FRAME_VERSION = 2;
+const uint16_t GRID_FRAME_DELTA = 1;
+const size_t GRID_FRAME_HEADER_SIZE = 32;
+
+// Appends value to out in little-endian byte order
+template <typename T>
+inline void append_little_endian(std::string &out, T value)
+{
+    for (size_t byte = 0; byte < sizeof(T); byte++) {
+        out.push_back((char)(((uint64_t)value >> (8 * byte)) & 0xff));
+    }
+}
+
+// Appends a column of int16 values. On little-endian hosts the grid's own
+// storage already has the wire layout and is copied as a block.
+inline void append_int16_column(std::string &out, const std::vector<int16_t> &column)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    size_t offset = out.size();
+    out.resize(offset + column.size() * sizeof(int16_t));
+    std::memcpy(&out[offset], column.data(), column.size() * sizeof(int16_t));
+#else
+    for (int16_t value : column) {
+        append_little_endian(out, (uint16_t)value);
+    }
+#endif
+}
+
+inline void append_grid_frame_header(std::string &out, const entity_grid_t &g, uint16_t flags, uint64_t tick, uint32_t run, uint32_t base_tick)
+{
+    out.append(GRID_FRAME_MAGIC, sizeof(GRID_FRAME_MAGIC));
+    append_little_endian(out, GRID_FRAME_VERSION);
+    append_little_endian(out, flags);
+    append_little_endian(out, g.num_rows);
+    append_little_endian(out, g.num_cols);
+    append_little_endian(out, tick);
+    append_little_endian(out, run);
+    append_little_endian(out, base_tick);
+}
+
+// Encodes the whole grid as a full frame
+inline std::string grid_to_binary(const entity_grid_t &g, uint32_t tick, uint32_t run)
+{
+    std::string out;
+    out.reserve(GRID_FRAME_HEADER_SIZE + g.size() * 5 + 1);
+    append_grid_frame_header(out, g, 0, tick, run, tick);
+
+    static_assert(sizeof(entity_type_t) == 1, "types are sent as one byte each");
+    out.append((const char *)g.type.data(), g.type.size());
+    if (g.type.size() % 2 == 1) {
+        out.push_back('\0');
+    }
+    append_int16_column(out, g.energy);
+    append_int16_column(out, g.age);
+    return out;
+}
+
+// Encodes the given cells of the grid as a delta frame over base_tick
+inline std::string grid_delta_to_binary(const entity_grid_t &g, const std::vector<uint32_t> &cells, uint32_t tick, uint32_t run, uint32_t base_tick)
+{
+    std::string out;
+    out.reserve(GRID_FRAME_HEADER_SIZE + 4 + cells.size() * 9 + 1);
+    append_grid_frame_header(out, g, GRID_FRAME_DELTA, tick, run, base_tick);
+    append_little_endian(out, (uint32_t)cells.size());
+    for (uint32_t idx : cells) {
+        append_little_endian(out, idx);
+    }
+    for (uint32_t idx : cells) {
+        out.push_back((char)g.type[idx]);
+    }
+    if (cells.size() % 2 == 1) {
+        out.push_back('\0');
+    }
+    for (uint32_t idx : cells) {
+        append_little_endian(out, (uint16_t)g.energy[idx]);
+    }
+    for (uint32_t idx : cells) {
+        append_little_endian(out, (uint16_t)g.age[idx]);
+    }
+    return out;
+}
+
+#endif
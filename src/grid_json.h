@@ -0,0 +1,42 @@
+#ifndef ECOSIM_GRID_JSON_H
+#define ECOSIM_GRID_JSON_H
+
+#include "json.hpp"
+#include "simulation.h"
+
+// Auxiliary code to convert the entity_type_t enum to a string
+NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
+                                                {empty, " "},
+                                                {plant, "P"},
+                                                {herbivore, "H"},
+                                                {carnivore, "C"},
+                                            })
+
+// Auxiliary code to convert the grid to a JSON array of rows of entity objects
+namespace nlohmann
+{
+    inline void to_json(nlohmann::json &j, const entity_grid_t &g)
+    {
+        j = nlohmann::json::array();
+        for (uint32_t row = 0; row < g.num_rows; row++) {
+            nlohmann::json json_row = nlohmann::json::array();
+            for (uint32_t col = 0; col < g.num_cols; col++) {
+                uint32_t idx = g.index(row, col);
+                json_row.push_back({{"type", g.type[idx]}, {"energy", g.energy[idx]}, {"age", g.age[idx]}});
+            }
+            j.push_back(std::move(json_row));
+        }
+    }
+}
+
+// The given cells of the grid, as entity objects with their index
+inline nlohmann::json grid_cells_to_json(const entity_grid_t &g, const std::vector<uint32_t> &cells)
+{
+    nlohmann::json j = nlohmann::json::array();
+    for (uint32_t idx : cells) {
+        j.push_back({{"index", idx}, {"type", g.type[idx]}, {"energy", g.energy[idx]}, {"age", g.age[idx]}});
+    }
+    return j;
+}
+
+#endif
@@ -0,0 +1,413 @@
+// Load generator for the HTTP server: starts ecosim (or targets one already
+// running), keeps a number of connections sending /next-iteration and, now and
+// then, /start-simulation requests at a given rate, and reports the latency
+// percentiles and the throughput of each endpoint.
+//
+// With a target rate the requests are scheduled on a fixed timetable and their
+// latency is measured from the scheduled time, so a slow server also gets
+// charged for the requests it delayed (no coordinated omission).
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using steady_clock = std::chrono::steady_clock;
+
+struct load_options_t
+{
+    std::string server_path = "./ecosim"; // empty to use a server that is already running
+    std::string server_workers;
+    std::string host = "127.0.0.1";
+    uint16_t port = 8080;
+    uint32_t connections = 32;
+    double rate = 0;             // requests per second over all connections, 0 for as fast as possible
+    double duration = 10;        // seconds
+    double start_fraction = 0.01; // share of the requests that restart the simulation
+    std::string start_body = "{\"rows\":100,\"cols\":100,\"plants\":2000,\"herbivores\":500,\"carnivores\":100}";
+    std::string next_query;      // appended to /next-iteration, e.g. "?steps=10"
+};
+
+enum endpoint_t
+{
+    endpoint_start,
+    endpoint_next,
+    NUM_ENDPOINTS
+};
+
+const char *const ENDPOINT_NAMES[NUM_ENDPOINTS] = {"/start-simulation", "/next-iteration"};
+
+// Results gathered by one connection, merged once the run is over
+struct connection_results_t
+{
+    std::vector<uint64_t> latencies_ns[NUM_ENDPOINTS];
+    uint64_t errors[NUM_ENDPOINTS] = {};
+    uint64_t bytes = 0;
+    uint64_t unsent = 0; // scheduled before the end but still waiting for the connection
+};
+
+// Blocking HTTP/1.1 keep-alive client, just enough for Crow's responses
+class http_connection_t
+{
+public:
+    http_connection_t(const std::string &host, uint16_t port) : host(host), port(port) {}
+    ~http_connection_t() { disconnect(); }
+
+    // Sends a request and reads the whole response. Returns the status code, or
+    // 0 on a connection error (the next request reconnects).
+    int request(const std::string &method, const std::string &target, const std::string &body, size_t &body_size)
+    {
+        if (fd < 0 && !connect_socket()) {
+            return 0;
+        }
+
+        std::string message = method + " " + target + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: keep-alive\r\n";
+        if (!body.empty()) {
+            message += "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+        }
+        message += "\r\n" + body;
+        if (!send_all(message)) {
+            disconnect();
+            return 0;
+        }
+
+        int status = read_response(body_size);
+        if (status == 0) {
+            disconnect();
+        }
+        return status;
+    }
+
+private:
+    bool connect_socket()
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        inet_pton(AF_INET, host.c_str(), &address.sin_addr);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+            disconnect();
+            return false;
+        }
+        buffer.clear();
+        return true;
+    }
+
+    void disconnect()
+    {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    bool send_all(const std::string &data)
+    {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    bool fill_buffer()
+    {
+        char chunk[65536];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(chunk, n);
+        return true;
+    }
+
+    int read_response(size_t &body_size)
+    {
+        size_t header_end;
+        while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!fill_buffer()) {
+                return 0;
+            }
+        }
+
+        std::string headers = buffer.substr(0, header_end);
+        int status = 0;
+        if (sscanf(headers.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+            return 0;
+        }
+        std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+        size_t length_at = headers.find("content-length:");
+        body_size = length_at == std::string::npos ? 0 : std::strtoull(headers.c_str() + length_at + 15, nullptr, 10);
+        bool closing = headers.find("connection: close") != std::string::npos;
+
+        size_t total = header_end + 4 + body_size;
+        while (buffer.size() < total) {
+            if (!fill_buffer()) {
+                return 0;
+            }
+        }
+        buffer.erase(0, total);
+        if (closing) {
+            disconnect();
+        }
+        return status;
+    }
+
+    std::string host;
+    uint16_t port;
+    int fd = -1;
+    std::string buffer;
+};
+
+static steady_clock::time_point after_seconds(steady_clock::time_point start, double seconds) {
+    return start + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+// Request stream of one connection. Connection c of n sends the requests
+// numbered k * n + c; with a target rate, request r is due at start + r / rate.
+static void run_connection(const load_options_t &options, uint32_t index, steady_clock::time_point start,
+                           steady_clock::time_point end, connection_results_t &results) {
+    http_connection_t connection(options.host, options.port);
+    for (uint64_t k = 0;; k++) {
+        uint64_t number = k * options.connections + index;
+        steady_clock::time_point scheduled = steady_clock::now();
+        if (options.rate > 0) {
+            scheduled = after_seconds(start, number / options.rate);
+            std::this_thread::sleep_until(scheduled);
+        }
+        if (scheduled >= end) {
+            return;
+        }
+        if (steady_clock::now() >= end) {
+            // The server fell behind the timetable, count what it never got to see
+            results.unsent += (uint64_t)((std::chrono::duration<double>(end - scheduled).count()) * options.rate / options.connections) + 1;
+            return;
+        }
+
+        // Spread the /start-simulation requests evenly over the request numbers
+        endpoint_t endpoint = endpoint_next;
+        if ((uint64_t)((number + 1) * options.start_fraction) > (uint64_t)(number * options.start_fraction)) {
+            endpoint = endpoint_start;
+        }
+
+        size_t body_size = 0;
+        int status = endpoint == endpoint_start
+                         ? connection.request("POST", "/start-simulation", options.start_body, body_size)
+                         : connection.request("GET", "/next-iteration" + options.next_query, "", body_size);
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - scheduled).count();
+
+        if (status == 200) {
+            results.latencies_ns[endpoint].push_back(latency);
+            results.bytes += body_size;
+        }
+        else {
+            results.errors[endpoint]++;
+            if (status == 0 && options.rate == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    }
+}
+
+static double percentile_ms(const std::vector<uint64_t> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+    return sorted[rank] / 1e6;
+}
+
+static bool wait_for_server(const load_options_t &options, double seconds) {
+    auto deadline = after_seconds(steady_clock::now(), seconds);
+    while (steady_clock::now() < deadline) {
+        http_connection_t probe(options.host, options.port);
+        size_t body_size;
+        if (probe.request("GET", "/stats", "", body_size) == 200) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --server PATH        server binary to start (default ./ecosim)\n"
+            "  --server-workers N   worker threads of the started server (default: its own default)\n"
+            "  --no-server          target a server that is already running\n"
+            "  --host ADDRESS       server IPv4 address (default 127.0.0.1)\n"
+            "  --port N             server port (default 8080)\n"
+            "  --connections N      concurrent connections (default 32)\n"
+            "  --rate R             total requests per second, 0 for as fast as possible (default 0)\n"
+            "  --duration S         seconds to run (default 10)\n"
+            "  --start-fraction F   share of the requests that are /start-simulation (default 0.01)\n"
+            "  --start-body JSON    body of the /start-simulation requests\n"
+            "  --next-query QUERY   query string of the /next-iteration requests, e.g. '?steps=10'\n",
+            program);
+}
+
+int main(int argc, char *argv[])
+{
+    load_options_t options;
+    for (int k = 1; k < argc; k++) {
+        std::string option = argv[k];
+        if (option == "--help" || option == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (option == "--no-server") {
+            options.server_path.clear();
+            continue;
+        }
+        if (k + 1 == argc) {
+            fprintf(stderr, "missing value for %s\n", option.c_str());
+            return 2;
+        }
+        std::string value = argv[++k];
+        char *end = nullptr;
+        double number = std::strtod(value.c_str(), &end);
+        bool numeric = !value.empty() && *end == '\0' && number >= 0;
+
+        if (option == "--server") {
+            options.server_path = value;
+        }
+        else if (option == "--server-workers") {
+            options.server_workers = value;
+        }
+        else if (option == "--host") {
+            options.host = value;
+        }
+        else if (option == "--start-body") {
+            options.start_body = value;
+        }
+        else if (option == "--next-query") {
+            options.next_query = value;
+        }
+        else if (!numeric) {
+            fprintf(stderr, "invalid value for %s: %s\n", option.c_str(), value.c_str());
+            return 2;
+        }
+        else if (option == "--port") {
+            options.port = number;
+        }
+        else if (option == "--connections") {
+            options.connections = std::max(1.0, number);
+        }
+        else if (option == "--rate") {
+            options.rate = number;
+        }
+        else if (option == "--duration") {
+            options.duration = number;
+        }
+        else if (option == "--start-fraction") {
+            options.start_fraction = std::min(1.0, number);
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", option.c_str());
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    pid_t server = -1;
+    if (!options.server_path.empty()) {
+        server = fork();
+        if (server == 0) {
+            // The server prints a line per request, keep it out of the report
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+            const char *server_argv[] = {options.server_path.c_str(),
+                                         options.server_workers.empty() ? nullptr : options.server_workers.c_str(), nullptr};
+            execv(options.server_path.c_str(), (char *const *)server_argv);
+            _exit(127);
+        }
+    }
+    if (!wait_for_server(options, 10)) {
+        fprintf(stderr, "server not reachable on %s:%u\n", options.host.c_str(), options.port);
+        if (server > 0) {
+            kill(server, SIGTERM);
+            waitpid(server, nullptr, 0);
+        }
+        return 1;
+    }
+
+    // Every connection needs a simulation to advance
+    http_connection_t setup(options.host, options.port);
+    size_t body_size;
+    setup.request("POST", "/start-simulation", options.start_body, body_size);
+
+    std::vector<connection_results_t> results(options.connections);
+    std::vector<std::thread> threads;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point end = after_seconds(start, options.duration);
+    for (uint32_t c = 0; c < options.connections; c++) {
+        threads.emplace_back(run_connection, std::cref(options), c, start, end, std::ref(results[c]));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+    }
+
+    printf("%u connections, %.1f s, target rate %s\n", options.connections, elapsed,
+           options.rate > 0 ? (std::to_string((int)options.rate) + " req/s").c_str() : "unlimited");
+    printf("%-18s %9s %7s %10s %10s %10s %10s %10s\n", "endpoint", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+    uint64_t bytes = 0;
+    std::vector<uint64_t> all;
+    uint64_t all_errors = 0;
+    for (uint32_t e = 0; e < NUM_ENDPOINTS; e++) {
+        std::vector<uint64_t> latencies;
+        uint64_t errors = 0;
+        for (const connection_results_t &result : results) {
+            latencies.insert(latencies.end(), result.latencies_ns[e].begin(), result.latencies_ns[e].end());
+            errors += result.errors[e];
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("%-18s %9zu %7llu %10.1f %10.3f %10.3f %10.3f %10.3f\n", ENDPOINT_NAMES[e], latencies.size(), (unsigned long long)errors,
+               latencies.size() / elapsed, percentile_ms(latencies, 0.5), percentile_ms(latencies, 0.99),
+               percentile_ms(latencies, 0.999), latencies.empty() ? 0.0 : latencies.back() / 1e6);
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        all_errors += errors;
+    }
+    uint64_t unsent = 0;
+    for (const connection_results_t &result : results) {
+        bytes += result.bytes;
+        unsent += result.unsent;
+    }
+
+    std::sort(all.begin(), all.end());
+    printf("%-18s %9zu %7llu %10.1f %10.3f %10.3f %10.3f %10.3f\n", "total", all.size(), (unsigned long long)all_errors,
+           all.size() / elapsed, percentile_ms(all, 0.5), percentile_ms(all, 0.99), percentile_ms(all, 0.999),
+           all.empty() ? 0.0 : all.back() / 1e6);
+    printf("received %.1f MB (%.1f MB/s)\n", bytes / 1e6, bytes / 1e6 / elapsed);
+    if (unsent > 0) {
+        printf("%llu scheduled requests were never sent, the server couldn't keep up with the rate\n", (unsigned long long)unsent);
+    }
+    return all_errors > 0 ? 3 : 0;
+}
@@ -0,0 +1,167 @@
+#ifndef ECOSIM_LOGGER_H
+#define ECOSIM_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+// Leveled logging. Calls below ECOSIM_LOG_LEVEL are removed by the preprocessor,
+// so they cost nothing in a normal build. The ones that remain format their
+// message into a lock-free ring buffer and return; a background thread writes
+// the buffer to stderr, so the caller never waits on I/O or on a stdio lock.
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF 5
+
+#ifndef ECOSIM_LOG_LEVEL
+#define ECOSIM_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if ECOSIM_LOG_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) async_logger::instance().log(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#endif
+
+#if ECOSIM_LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) async_logger::instance().log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if ECOSIM_LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) async_logger::instance().log(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if ECOSIM_LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) async_logger::instance().log(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#if ECOSIM_LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) async_logger::instance().log(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+// Bounded multi-producer ring of formatted messages (Vyukov's sequence-numbered
+// queue) with one background consumer. A full ring drops the message and counts
+// it instead of blocking the producer.
+class async_logger
+{
+public:
+    static const size_t CAPACITY = 4096; // power of two
+    static const size_t MESSAGE_SIZE = 120;
+
+    static async_logger &instance()
+    {
+        static async_logger logger;
+        return logger;
+    }
+
+    void log(int level, const char *format, ...) __attribute__((format(printf, 3, 4)))
+    {
+        uint64_t position = tail.load(std::memory_order_relaxed);
+        slot_t *slot;
+        while (true) {
+            slot = &slots[position & (CAPACITY - 1)];
+            int64_t lag = (int64_t)(slot->sequence.load(std::memory_order_acquire) - position);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (lag < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level;
+        va_list args;
+        va_start(args, format);
+        vsnprintf(slot->text, MESSAGE_SIZE, format, args);
+        va_end(args);
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    async_logger(const async_logger &) = delete;
+    async_logger &operator=(const async_logger &) = delete;
+
+private:
+    struct slot_t
+    {
+        std::atomic<uint64_t> sequence;
+        int level;
+        char text[MESSAGE_SIZE];
+    };
+
+    async_logger()
+    {
+        for (size_t k = 0; k < CAPACITY; k++) {
+            slots[k].sequence.store(k, std::memory_order_relaxed);
+        }
+        drain_thread = std::thread(&async_logger::drain_loop, this);
+    }
+
+    // Writes whatever is left before the program exits
+    ~async_logger()
+    {
+        stopping.store(true, std::memory_order_release);
+        drain_thread.join();
+    }
+
+    bool drain()
+    {
+        static const char *const LEVEL_NAMES[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+        bool drained = false;
+        while (true) {
+            slot_t &slot = slots[head & (CAPACITY - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+                break;
+            }
+            fprintf(stderr, "[%s] %s\n", LEVEL_NAMES[slot.level], slot.text);
+            slot.sequence.store(head + CAPACITY, std::memory_order_release);
+            head++;
+            drained = true;
+        }
+
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            fprintf(stderr, "[WARN] %llu log messages dropped, ring buffer full\n", (unsigned long long)lost);
+        }
+        return drained;
+    }
+
+    void drain_loop()
+    {
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (!drain()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        }
+        drain();
+        fflush(stderr);
+    }
+
+    slot_t slots[CAPACITY];
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint64_t> dropped{0};
+    alignas(64) uint64_t head = 0; // only touched by the drain thread
+    std::atomic<bool> stopping{false};
+    std::thread drain_thread;
+};
+
+#endif
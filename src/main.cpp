@@ -2,493 +2,602 @@
 #define CROW_STATIC_DIR "../public"
 
 #include "crow_all.h"
-#include "json.hpp"
+#include "grid_binary.h"
+#include "grid_json.h"
+#include "logger.h"
+#include "metrics.h"
+#include "simulation.h"
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <thread>
-#include <mutex>
+#include <unordered_map>
 
-static const uint32_t NUM_ROWS = 15;
+// Upper bound of the iterations a single request may advance
+const uint64_t MAXIMUM_STEPS_PER_REQUEST = 10000000;
 
-// Constants
-const uint32_t PLANT_MAXIMUM_AGE = 10;
-const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
-const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
-const uint32_t MAXIMUM_ENERGY = 200;
-const uint32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
+// Upper bound of the population samples returned by /next-iteration with counts=1;
+// longer requests sample every few iterations
+const uint64_t MAXIMUM_POPULATION_SAMPLES = 10000;
 
-// Probabilities
-const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
-const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
-const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
-const double HERBIVORE_MOVE_PROBABILITY = 0.7;
-const double HERBIVORE_EAT_PROBABILITY = 0.9;
-const double CARNIVORE_MOVE_PROBABILITY = 0.5;
-const double CARNIVORE_EAT_PROBABILITY = 1.0;
+// Crow runs handlers on several threads, only one of them may drive the engine at a time
+static std::mutex simulation_mutex;
 
-bool threads_created = false;
+// Parses an unsigned decimal query parameter in [0, maximum]
+bool parse_unsigned_param(const char *text, uint64_t maximum, uint64_t &value) {
+    char *end;
+    value = std::strtoull(text, &end, 10);
+    return *text != '\0' && *text != '-' && *end == '\0' && value <= maximum;
+}
 
-// Type definitions
-enum entity_type_t
-{
-    empty,
-    plant,
-    herbivore,
-    carnivore
-};
+// Parses an unsigned decimal query parameter in [1, maximum]
+bool parse_positive_param(const char *text, uint64_t maximum, uint64_t &value) {
+    return parse_unsigned_param(text, maximum, value) && value >= 1;
+}
 
-struct pos_t
-{
-    uint32_t i;
-    uint32_t j;
-    // Sobrecarga do operador de igualdade
-    bool operator==(const pos_t& other) const {
-        return i == other.i && j == other.j;
+// Reads an optional unsigned integer field of a JSON body in [0, maximum], a
+// missing field keeps value as is
+bool read_unsigned_field(const nlohmann::json &body, const char *field, uint64_t maximum, uint64_t &value) {
+    if (!body.contains(field)) {
+        return true;
     }
-};
-
-struct entity_t
-{
-    entity_type_t type;
-    int32_t energy;
-    int32_t age;
-    bool already_atualized;
-};
-// Auxiliary code to convert the entity_type_t enum to a string
-NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
-                                                {empty, " "},
-                                                {plant, "P"},
-                                                {herbivore, "H"},
-                                                {carnivore, "C"},
-                                            })
-
-// Auxiliary code to convert the entity_t struct to a JSON object
-namespace nlohmann
-{
-    void to_json(nlohmann::json &j, const entity_t &e)
-    {
-        j = nlohmann::json{{"type", e.type}, {"energy", e.energy}, {"age", e.age}};
+    if (!body[field].is_number_unsigned() || body[field].get<uint64_t>() > maximum) {
+        return false;
     }
+    value = body[field].get<uint64_t>();
+    return true;
 }
 
-// Grid that contains the entities
-static std::vector<std::vector<entity_t>> entity_grid;
-
-bool random_action(float probability) {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(0.0, 1.0);
-    return dis(gen) < probability;
+// Reads an optional finite, non-negative number field of a JSON body
+bool read_non_negative_field(const nlohmann::json &body, const char *field, double &value) {
+    if (!body.contains(field)) {
+        return true;
+    }
+    if (!body[field].is_number() || !std::isfinite(body[field].get<double>()) || body[field].get<double>() < 0) {
+        return false;
+    }
+    value = body[field].get<double>();
+    return true;
 }
 
-std::mutex cv_mutex;
-std::condition_variable cv;
-
-void simul_plant(int i, int j) {
-
-    std::unique_lock<std::mutex> lock(cv_mutex);
-    printf("parou no wait planta\n");
-    while(!threads_created)
-    {
-        cv.wait(lock);
+// Reads an optional boolean field of a JSON body
+bool read_bool_field(const nlohmann::json &body, const char *field, bool &value) {
+    if (!body.contains(field)) {
+        return true;
     }
-
-    std::vector<pos_t> growth_positions_available;
-    printf("saiu no wait planta\n");
-
-    if(i+1 < NUM_ROWS) {
-        if(entity_grid[i+1][j].type == empty) {
-            pos_t position_available;
-            position_available.i = i+1;
-            position_available.j = j;
-            growth_positions_available.push_back(position_available);
-        }
+    if (!body[field].is_boolean()) {
+        return false;
     }
+    value = body[field].get<bool>();
+    return true;
+}
 
-    if(i > 0) {
-        if(entity_grid[i-1][j].type == empty) {
-            pos_t position_available;
-            position_available.i = i-1;
-            position_available.j = j;
-            growth_positions_available.push_back(position_available);
-        }
-    }
+// Endpoints whose latency and response size are tracked by /metrics, anything
+// else is counted under "other"
+const char *const TRACKED_PATHS[] = {"/start-simulation", "/next-iteration", "/run-until", "/stats", "/worker-stats", "/metrics",
+                                     "/pause", "/resume", "/loop", "other"};
+const size_t NUM_TRACKED_PATHS = sizeof(TRACKED_PATHS) / sizeof(TRACKED_PATHS[0]);
 
-    if(j+1 < NUM_ROWS) {
-        if(entity_grid[i][j+1].type == empty){
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j+1;
-            growth_positions_available.push_back(position_available);
-        }
-    }
+static latency_histogram_t request_latency[NUM_TRACKED_PATHS];
+static std::atomic<uint64_t> response_bytes[NUM_TRACKED_PATHS];
+static latency_histogram_t serialize_latency; // grid to JSON text or binary frame in /start-simulation and /next-iteration
 
-    if(j > 0) {
-        if(entity_grid[i][j-1].type == empty) {
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j-1;
-            growth_positions_available.push_back(position_available);
+size_t tracked_path(const std::string &url) {
+    for (size_t path = 0; path + 1 < NUM_TRACKED_PATHS; path++) {
+        if (url == TRACKED_PATHS[path]) {
+            return path;
         }
     }
+    return NUM_TRACKED_PATHS - 1;
+}
 
-    if (!growth_positions_available.empty()) {
-        bool try_to_reproduct = random_action(PLANT_REPRODUCTION_PROBABILITY);
-        if(try_to_reproduct == true) {
-            std::random_device rd;  
-            std::mt19937 gen(rd());  
-            std::uniform_int_distribution<> dis(0, growth_positions_available.size() - 1);
-            pos_t sorted_position = growth_positions_available[dis(gen)];
-        
-            entity_grid[sorted_position.i][sorted_position.j].type = plant;
-            entity_grid[sorted_position.i][sorted_position.j].energy = 0;
-            entity_grid[sorted_position.i][sorted_position.j].age = 0;
-            entity_grid[sorted_position.i][sorted_position.j].already_atualized = true;
-        }
-    }
+uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
-    entity_grid[i][j].age += 1;  // aumenta a idade da planta em 1
+// Crow middleware that times every request and counts the bytes of its response
+// body (static files are sent apart from the body and aren't counted)
+struct request_metrics_t
+{
+    struct context
+    {
+        std::chrono::steady_clock::time_point start;
+    };
 
-    if (entity_grid[i][j].age == PLANT_MAXIMUM_AGE) {  // verifica se a planta atingiu a idade maxima e se sim a planta morre
-        entity_grid[i][j].type = empty;
-        entity_grid[i][j].energy = 0;
-        entity_grid[i][j].age = 0;
-    }
+    void before_handle(crow::request &, crow::response &, context &ctx) { ctx.start = std::chrono::steady_clock::now(); }
 
-    // Libera os mutexes das posições adjacentes
-    printf("terminou planta planta\n");
+    void after_handle(crow::request &req, crow::response &res, context &ctx)
+    {
+        size_t path = tracked_path(req.url);
+        request_latency[path].record(nanoseconds_since(ctx.start));
+        response_bytes[path].fetch_add(res.body.size(), std::memory_order_relaxed);
+    }
+};
 
+// Converts the grid to JSON text, timing it for /metrics
+std::string serialize_grid(nlohmann::json &json_grid) {
+    auto start = std::chrono::steady_clock::now();
+    std::string text = json_grid.dump();
+    serialize_latency.record(nanoseconds_since(start));
+    return text;
+}
 
+// Encodes a snapshot's grid as a binary frame (see grid_binary.h), timing it for
+// /metrics. With delta set it holds only the given cells, changed since base_tick.
+std::string serialize_grid_binary(const grid_snapshot_t &snapshot, bool delta, const std::vector<uint32_t> &cells, uint32_t base_tick) {
+    auto start = std::chrono::steady_clock::now();
+    std::string frame = delta ? grid_delta_to_binary(snapshot.grid, cells, snapshot.tick, snapshot.run, base_tick)
+                              : grid_to_binary(snapshot.grid, snapshot.tick, snapshot.run);
+    serialize_latency.record(nanoseconds_since(start));
+    return frame;
 }
 
-void simul_herbivore(int i, int j) {
-    std::unique_lock<std::mutex> lock(cv_mutex);
-    printf("parou no wait herbivoro\n");
-    while(!threads_created)
-    {
-        cv.wait(lock);
+// Grid update in the JSON form of a delta response: the changed cells with their
+// base tick, or the whole grid when full
+nlohmann::json grid_update_json(const grid_snapshot_t &snapshot, bool delta, const std::vector<uint32_t> &cells, uint32_t base_tick) {
+    nlohmann::json update = {{"run", snapshot.run}, {"tick", snapshot.tick}, {"full", !delta}};
+    if (delta) {
+        update["base_tick"] = base_tick;
+        update["changes"] = grid_cells_to_json(snapshot.grid, cells);
     }
-    printf("saiu no wait herbivoro\n");
-    std::vector<pos_t> neighboring_empty_positions; // vetor das posicoes vazias adjacentes
-    std::vector<pos_t> neighboring_plants_positions; // vetor das posicoes com planta adjacentes
-
-    if(i+1 < NUM_ROWS) {
-        if(entity_grid[i+1][j].type == empty) {
-            pos_t position_available;
-            position_available.i = i+1;
-            position_available.j = j;
-            neighboring_empty_positions.push_back(position_available);
-        }
-        if(entity_grid[i+1][j].type == plant) {
-            pos_t position_available;
-            position_available.i = i+1;
-            position_available.j = j;
-            neighboring_plants_positions.push_back(position_available);
-        }
+    else {
+        update["grid"] = snapshot.grid;
     }
+    return update;
+}
+
+// Looks up the cells changed since the client's base tick. Returns false when
+// a full grid has to be sent instead: the base is unknown or too old, or so
+// much has changed that listing the cells would cost more than the grid.
+bool delta_cells(const grid_snapshot_t &snapshot, uint32_t run, uint32_t base_tick, std::vector<uint32_t> &cells) {
+    return snapshot.cells_changed_since(run, base_tick, cells) && cells.size() * 2 <= snapshot.grid.size();
+}
+
+// Where the last frame handed to a subscriber's connection is. A subscriber has
+// at most one frame on its way: grid changes broadcast meanwhile are skipped,
+// and once the frame is written it catches up with the latest snapshot.
+enum frame_state_t
+{
+    frame_written, // written to the socket, or none sent yet
+    frame_queued,  // posted to the connection's thread
+    frame_sending  // handed to Crow, not fully written to the socket yet
+};
+
+// Subscribers whose frame isn't written for this long have stopped reading and
+// are disconnected
+const std::chrono::seconds STREAM_STALL_TIMEOUT(10);
+
+// Clients of the /ws stream and the format each one asked for. Every connection
+// gets a frame whenever the grid changes; with delta, only the cells changed
+// since the last frame it was sent.
+struct stream_subscriber_t
+{
+    bool binary = false;
+    bool delta = false;
+    bool has_frame = false; // whether run and tick are those of a frame already sent
+    uint32_t run = 0;
+    uint32_t tick = 0;
+    uint64_t id = 0; // tells the connection apart from a later one at the same address
+    frame_state_t frame_state = frame_written;
+    std::chrono::steady_clock::time_point frame_since; // when the frame on its way was encoded
+    bool stalled = false; // being disconnected for not reading
+};
 
-    if(i > 0) {
-        if(entity_grid[i-1][j].type == empty) {
-            pos_t position_available;
-            position_available.i = i-1;
-            position_available.j = j;
-            neighboring_empty_positions.push_back(position_available);
+static std::mutex subscribers_mutex;
+static std::unordered_map<crow::websocket::connection *, stream_subscriber_t> subscribers;
+static uint64_t next_subscriber_id = 0;
+// Run and tick of the last snapshot broadcast, so that one published earlier but
+// broadcast late doesn't take subscribers back
+static std::pair<uint32_t, uint32_t> broadcast_position;
+
+// Frames encoded during one broadcast, by format and base tick (-1 for full)
+typedef std::map<std::pair<bool, int64_t>, std::shared_ptr<const std::string>> frame_cache_t;
+static std::atomic<uint64_t> stream_frames{0};
+static std::atomic<uint64_t> stream_bytes{0};
+static std::atomic<uint64_t> stream_skipped{0};
+static std::atomic<uint64_t> stream_stalled{0};
+
+// Crow runs each connection on one thread and deletes it there once it closes,
+// so a send queued from any other thread could run after the delete. Frames are
+// handed to the connection's thread instead, and sent only if the subscriber is
+// still registered by then: onclose runs on that same thread.
+void push_frame(crow::websocket::connection &connection, uint64_t id, std::shared_ptr<const std::string> frame, bool binary) {
+    auto &socket = static_cast<crow::websocket::Connection<crow::SocketAdaptor> &>(connection);
+    socket.post([&socket, id, frame, binary] {
+        {
+            std::lock_guard<std::mutex> lock(subscribers_mutex);
+            auto subscriber = subscribers.find(&socket);
+            if (subscriber == subscribers.end() || subscriber->second.id != id) {
+                return;
+            }
+            subscriber->second.frame_state = frame_sending;
         }
-        if(entity_grid[i-1][j].type == plant) {
-            pos_t position_available;
-            position_available.i = i-1;
-            position_available.j = j;
-            neighboring_plants_positions.push_back(position_available);
+        if (binary) {
+            socket.send_binary(*frame);
         }
-    }
+        else {
+            socket.send_text(*frame);
+        }
+    });
+}
 
-    if(j+1 < NUM_ROWS) {
-        if(entity_grid[i][j+1].type == empty){
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j+1;
-            neighboring_empty_positions.push_back(position_available);
+// Encodes a snapshot's grid in the format a subscriber asked for, reusing the
+// frames already encoded for others with the same format and base tick
+std::shared_ptr<const std::string> encode_frame(const stream_subscriber_t &subscriber, const grid_snapshot_t &snapshot, frame_cache_t &frames) {
+    std::vector<uint32_t> cells;
+    bool delta = subscriber.delta && subscriber.has_frame && delta_cells(snapshot, subscriber.run, subscriber.tick, cells);
+    std::pair<bool, int64_t> key(subscriber.binary, delta ? (int64_t)subscriber.tick : -1);
+    auto frame = frames.find(key);
+    if (frame == frames.end()) {
+        std::string encoded;
+        if (subscriber.binary) {
+            encoded = serialize_grid_binary(snapshot, delta, cells, subscriber.tick);
         }
-        if(entity_grid[i][j+1].type == plant){
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j+1;
-            neighboring_plants_positions.push_back(position_available);
+        else {
+            nlohmann::json update = grid_update_json(snapshot, delta, cells, subscriber.tick);
+            encoded = serialize_grid(update);
         }
+        frame = frames.emplace(key, std::make_shared<const std::string>(std::move(encoded))).first;
     }
+    return frame->second;
+}
 
-    if(j > 0) {
-        if(entity_grid[i][j-1].type == empty) {
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j-1;
-            neighboring_empty_positions.push_back(position_available);
-        }if(entity_grid[i][j-1].type == plant) {
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j-1;
-            neighboring_plants_positions.push_back(position_available);
-        }
-    }
+bool same_stream_state(const stream_subscriber_t &a, const stream_subscriber_t &b) {
+    return a.id == b.id && a.binary == b.binary && a.delta == b.delta && a.has_frame == b.has_frame && a.run == b.run && a.tick == b.tick;
+}
 
-    // tentativa de comer uma planta
-    if (!neighboring_plants_positions.empty()) {
-        bool try_to_eat = random_action(HERBIVORE_EAT_PROBABILITY);
-        if(try_to_eat == true) {
-            std::random_device rd;  
-            std::mt19937 gen(rd());  
-            std::uniform_int_distribution<> dis(0, neighboring_plants_positions.size() - 1);
-            pos_t eat_position = neighboring_plants_positions[dis(gen)];
-        
-            entity_grid[eat_position.i][eat_position.j].type = empty;
-            entity_grid[eat_position.i][eat_position.j].energy = 0;
-            entity_grid[eat_position.i][eat_position.j].age = 0;
-            entity_grid[eat_position.i][eat_position.j].already_atualized = true;
-
-            if (entity_grid[i][j].energy + 30 >= MAXIMUM_ENERGY)
-            {
-                entity_grid[i][j].energy = MAXIMUM_ENERGY;
+// Disconnects a subscriber that stopped reading. The socket is shut down rather
+// than closed with a close frame, which would queue behind the unwritten frame.
+void drop_subscriber(crow::websocket::connection &connection, uint64_t id) {
+    auto &socket = static_cast<crow::websocket::Connection<crow::SocketAdaptor> &>(connection);
+    socket.post([&socket, id] {
+        {
+            std::lock_guard<std::mutex> lock(subscribers_mutex);
+            auto subscriber = subscribers.find(&socket);
+            if (subscriber == subscribers.end() || subscriber->second.id != id) {
+                return;
             }
-            else
-            {
-                entity_grid[i][j].energy = entity_grid[i][j].energy + 30;
-            }
-            neighboring_empty_positions.push_back(eat_position);
         }
-    }
+        socket.shutdown();
+    });
+}
 
-    // tentativa de se reproduzir
-    if (!neighboring_empty_positions.empty()) {
-        if(entity_grid[i][j].energy > THRESHOLD_ENERGY_FOR_REPRODUCTION) {
-            bool try_to_reproduce = random_action(HERBIVORE_REPRODUCTION_PROBABILITY);
-            if(try_to_reproduce == true) {
-                std::random_device rd;  
-                std::mt19937 gen(rd());  
-                std::uniform_int_distribution<> dis(0, neighboring_empty_positions.size() - 1);
-                pos_t child_position = neighboring_empty_positions[dis(gen)];
-            
-                entity_grid[child_position.i][child_position.j].type = herbivore;
-                entity_grid[child_position.i][child_position.j].energy = 100;
-                entity_grid[child_position.i][child_position.j].age = 0;
-                entity_grid[child_position.i][child_position.j].already_atualized = true;
-
-                entity_grid[i][j].energy = entity_grid[i][j].energy - 10;
-                for (auto it = neighboring_empty_positions.begin(); it != neighboring_empty_positions.end(); ++it) {
-                        if (*it == child_position) {
-                        neighboring_empty_positions.erase(it);
-                        break;  
-                    }
+// Pushes a snapshot to the subscribers that don't have it yet. Their formats are
+// copied under subscribers_mutex and the frames encoded without it, so that
+// connections opening or changing format don't wait for the encoding; one that
+// changed meanwhile is skipped, and gets its frame from the broadcast its change
+// queued. Subscribers still writing their previous frame are skipped too, and
+// dropped once it has been on its way for STREAM_STALL_TIMEOUT.
+void broadcast_frames(const snapshot_ref_t &snapshot) {
+    std::vector<std::pair<crow::websocket::connection *, stream_subscriber_t>> targets;
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        std::pair<uint32_t, uint32_t> position(snapshot->run, snapshot->tick);
+        if (position < broadcast_position) {
+            return;
+        }
+        broadcast_position = position;
+        for (auto &entry : subscribers) {
+            stream_subscriber_t &subscriber = entry.second;
+            if (subscriber.stalled || (subscriber.has_frame && subscriber.run == snapshot->run && subscriber.tick == snapshot->tick)) {
+                continue;
+            }
+            if (subscriber.frame_state != frame_written) {
+                stream_skipped.fetch_add(1, std::memory_order_relaxed);
+                if (now - subscriber.frame_since > STREAM_STALL_TIMEOUT) {
+                    subscriber.stalled = true;
+                    stream_stalled.fetch_add(1, std::memory_order_relaxed);
+                    drop_subscriber(*entry.first, subscriber.id);
                 }
+                continue;
             }
+            targets.push_back(entry);
         }
     }
 
-    bool age_increased = false;
-
-    // tentativa de se movimentar
-    if (!neighboring_empty_positions.empty()) {
-        bool try_to_move = random_action(HERBIVORE_MOVE_PROBABILITY);
-        if(try_to_move == true) {
-            std::random_device rd;  
-            std::mt19937 gen(rd());  
-            std::uniform_int_distribution<> dis(0, neighboring_empty_positions.size() - 1);
-            pos_t move_position = neighboring_empty_positions[dis(gen)];
-        
-            entity_grid[move_position.i][move_position.j].type = herbivore;
-            entity_grid[move_position.i][move_position.j].energy = entity_grid[i][j].energy - 5;
-            entity_grid[move_position.i][move_position.j].age = entity_grid[i][j].age + 1;
-            entity_grid[move_position.i][move_position.j].already_atualized = true;
-            age_increased = true;
-
-            entity_grid[i][j].type = empty;
-            entity_grid[i][j].energy = 0;
-            entity_grid[i][j].age = 0;
-            
-            if (entity_grid[move_position.i][move_position.j].age == HERBIVORE_MAXIMUM_AGE || entity_grid[move_position.i][move_position.j].energy <= 0) { 
-                entity_grid[move_position.i][move_position.j].type = empty;
-                entity_grid[move_position.i][move_position.j].energy = 0;
-                entity_grid[move_position.i][move_position.j].age = 0;
-            }
-        }
-    }
-    if(age_increased == false) {
-        entity_grid[i][j].age += 1;
+    frame_cache_t frames;
+    std::vector<std::shared_ptr<const std::string>> encoded;
+    for (const auto &target : targets) {
+        encoded.push_back(encode_frame(target.second, *snapshot, frames));
     }
 
-    if (entity_grid[i][j].age == HERBIVORE_MAXIMUM_AGE || entity_grid[i][j].energy <= 0) { 
-        entity_grid[i][j].type = empty;
-        entity_grid[i][j].energy = 0;
-        entity_grid[i][j].age = 0;
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    for (size_t k = 0; k < targets.size(); k++) {
+        auto subscriber = subscribers.find(targets[k].first);
+        if (subscriber == subscribers.end() || !same_stream_state(subscriber->second, targets[k].second)) {
+            continue;
+        }
+        push_frame(*subscriber->first, subscriber->second.id, encoded[k], subscriber->second.binary);
+        subscriber->second.frame_state = frame_queued;
+        subscriber->second.frame_since = now;
+        subscriber->second.has_frame = true;
+        subscriber->second.run = snapshot->run;
+        subscriber->second.tick = snapshot->tick;
+        stream_frames.fetch_add(1, std::memory_order_relaxed);
+        stream_bytes.fetch_add(encoded[k]->size(), std::memory_order_relaxed);
     }
-    printf("terminou herbivoro\n");
 }
 
-void simul_carnivore(int i, int j) {
-    std::unique_lock<std::mutex> lock(cv_mutex);
-    printf("parou wait carnivoro\n");
-    while(!threads_created)
+// Broadcasts run on a thread of their own, so that the loop and the handlers
+// that advance the simulation only hand over the snapshot they published and
+// never wait for the encoding. Only the newest snapshot waits to be broadcast:
+// one queued while the previous broadcast is still encoding replaces it.
+struct stream_broadcaster_t
+{
+    std::mutex mutex; // guards pending and stopping
+    std::condition_variable wakeup;
+    snapshot_ref_t pending;
+    bool stopping = false;
+};
+
+static stream_broadcaster_t stream_broadcaster;
+
+void queue_broadcast(snapshot_ref_t snapshot) {
     {
-        cv.wait(lock);
+        std::lock_guard<std::mutex> lock(stream_broadcaster.mutex);
+        snapshot_ref_t &pending = stream_broadcaster.pending;
+        if (!pending || std::make_pair(pending->run, pending->tick) <= std::make_pair(snapshot->run, snapshot->tick)) {
+            pending = std::move(snapshot);
+        }
     }
-    printf("saiu do wait carnivoro\n");
-
-    std::vector<pos_t> neighboring_empty_positions; // vetor das posicoes vazias adjacentes
-    std::vector<pos_t> neighboring_herbivore_positions; // vetor das posicoes com herbivoros adjacentes
+    stream_broadcaster.wakeup.notify_one();
+}
 
-    if(i+1 < NUM_ROWS) {
-        if(entity_grid[i+1][j].type == empty) {
-            pos_t position_available;
-            position_available.i = i+1;
-            position_available.j = j;
-            neighboring_empty_positions.push_back(position_available);
+// Called on a subscriber's thread whenever everything sent to it is written. Once
+// its frame is out, a subscriber that missed broadcasts meanwhile gets the latest
+// snapshot, as a delta from the frame it has when possible.
+void subscriber_drained(crow::websocket::connection &connection, uint64_t id) {
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        auto subscriber = subscribers.find(&connection);
+        if (subscriber == subscribers.end() || subscriber->second.id != id || subscriber->second.frame_state != frame_sending) {
+            return;
         }
-        if(entity_grid[i+1][j].type == herbivore) {
-            pos_t position_available;
-            position_available.i = i+1;
-            position_available.j = j;
-            neighboring_herbivore_positions.push_back(position_available);
+        subscriber->second.frame_state = frame_written;
+        if (subscriber->second.has_frame && std::make_pair(subscriber->second.run, subscriber->second.tick) >= broadcast_position) {
+            return;
         }
     }
+    queue_broadcast(latest_snapshot());
+}
 
-    if(i > 0) {
-        if(entity_grid[i-1][j].type == empty) {
-            pos_t position_available;
-            position_available.i = i-1;
-            position_available.j = j;
-            neighboring_empty_positions.push_back(position_available);
-        }
-        if(entity_grid[i-1][j].type == herbivore) {
-            pos_t position_available;
-            position_available.i = i-1;
-            position_available.j = j;
-            neighboring_herbivore_positions.push_back(position_available);
+void run_broadcaster() {
+    std::unique_lock<std::mutex> lock(stream_broadcaster.mutex);
+    while (true) {
+        stream_broadcaster.wakeup.wait(lock, [] { return stream_broadcaster.stopping || stream_broadcaster.pending; });
+        if (stream_broadcaster.stopping) {
+            return;
         }
+        snapshot_ref_t snapshot = std::move(stream_broadcaster.pending);
+        lock.unlock();
+        broadcast_frames(snapshot);
+        // Unpin the slot before waiting
+        snapshot = snapshot_ref_t();
+        lock.lock();
     }
+}
+
+// Background ticking. While running, the loop advances the simulation at
+// target_rate iterations per second (as fast as possible when zero) and the
+// handlers only read the published snapshots; while paused, clients advance it
+// themselves.
+// A tick that ends past the start of the next one is an overrun: it is counted
+// and the schedule restarts from then instead of bursting to catch up.
+struct simulation_loop_t
+{
+    std::mutex mutex; // guards target_rate, stopping and changes
+    std::condition_variable wakeup;
+    std::atomic<bool> running{false};
+    double target_rate = 0;
+    bool stopping = false;
+    uint64_t changes = 0; // bumped by every pause, resume or change of rate
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint64_t> overruns{0};
+    std::atomic<uint64_t> late_ns{0}; // time the overrunning ticks ended past their deadline
+};
 
-    if(j+1 < NUM_ROWS) {
-        if(entity_grid[i][j+1].type == empty){
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j+1;
-            neighboring_empty_positions.push_back(position_available);
+static simulation_loop_t simulation_loop;
+
+void run_simulation_loop(worker_pool &workers) {
+    std::unique_lock<std::mutex> lock(simulation_loop.mutex);
+    uint64_t seen_changes = simulation_loop.changes;
+    auto deadline = std::chrono::steady_clock::now();
+    while (true) {
+        simulation_loop.wakeup.wait(lock, [] { return simulation_loop.stopping || simulation_loop.running.load(); });
+        if (simulation_loop.stopping) {
+            return;
         }
-        if(entity_grid[i][j+1].type == herbivore){
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j+1;
-            neighboring_herbivore_positions.push_back(position_available);
+        if (seen_changes != simulation_loop.changes) {
+            seen_changes = simulation_loop.changes;
+            deadline = std::chrono::steady_clock::now();
+        }
+        double rate = simulation_loop.target_rate;
+        lock.unlock();
+
+        snapshot_ref_t snapshot;
+        {
+            std::lock_guard<std::mutex> simulation_lock(simulation_mutex);
+            if (entity_grid.size() > 0) {
+                next_iteration(workers);
+                snapshot = publish_snapshot();
+            }
+        }
+        if (snapshot) {
+            queue_broadcast(snapshot);
+        }
+        lock.lock();
+        if (!snapshot) {
+            // Nothing to simulate before the first /start-simulation
+            simulation_loop.wakeup.wait_for(lock, std::chrono::milliseconds(10));
+            deadline = std::chrono::steady_clock::now();
+            continue;
+        }
+        simulation_loop.ticks.fetch_add(1, std::memory_order_relaxed);
+        if (rate <= 0) {
+            continue;
         }
-    }
 
-    if(j > 0) {
-        if(entity_grid[i][j-1].type == empty) {
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j-1;
-            neighboring_empty_positions.push_back(position_available);
-        }if(entity_grid[i][j-1].type == herbivore) {
-            pos_t position_available;
-            position_available.i = i;
-            position_available.j = j-1;
-            neighboring_herbivore_positions.push_back(position_available);
+        deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / rate));
+        auto now = std::chrono::steady_clock::now();
+        if (now > deadline) {
+            simulation_loop.overruns.fetch_add(1, std::memory_order_relaxed);
+            simulation_loop.late_ns.fetch_add(nanoseconds_since(deadline), std::memory_order_relaxed);
+            deadline = now;
+        }
+        else {
+            simulation_loop.wakeup.wait_until(lock, deadline, [&] { return simulation_loop.stopping || seen_changes != simulation_loop.changes; });
         }
     }
+}
 
-    // tentativa de comer um herbivoro
-    if (!neighboring_herbivore_positions.empty()) {
-        bool try_to_eat = random_action(CARNIVORE_EAT_PROBABILITY);
-        if(try_to_eat == true) {
-            std::random_device rd;  
-            std::mt19937 gen(rd());  
-            std::uniform_int_distribution<> dis(0, neighboring_herbivore_positions.size() - 1);
-            pos_t eat_position = neighboring_herbivore_positions[dis(gen)];
-        
-            entity_grid[eat_position.i][eat_position.j].type = empty;
-            entity_grid[eat_position.i][eat_position.j].energy = 0;
-            entity_grid[eat_position.i][eat_position.j].age = 0;
-            entity_grid[eat_position.i][eat_position.j].already_atualized = true;
-            if (entity_grid[i][j].energy + 20 >= MAXIMUM_ENERGY)
-            {
-                entity_grid[i][j].energy = MAXIMUM_ENERGY;
-            }
-            else
-            {
-                entity_grid[i][j].energy = entity_grid[i][j].energy + 20;
-            }
-            neighboring_empty_positions.push_back(eat_position);
+// Pauses or resumes the loop; a resume with a negative rate keeps the current one
+void set_simulation_loop(bool running, double rate) {
+    {
+        std::lock_guard<std::mutex> lock(simulation_loop.mutex);
+        if (rate >= 0) {
+            simulation_loop.target_rate = rate;
         }
+        simulation_loop.running.store(running);
+        simulation_loop.changes++;
     }
+    simulation_loop.wakeup.notify_all();
+}
 
-    // tentativa de se reproduzir
-    if (!neighboring_empty_positions.empty()) {
-        if(entity_grid[i][j].energy > THRESHOLD_ENERGY_FOR_REPRODUCTION) {
-            bool try_to_reproduce = random_action(CARNIVORE_REPRODUCTION_PROBABILITY);
-            if(try_to_reproduce == true) {
-                std::random_device rd;  
-                std::mt19937 gen(rd());  
-                std::uniform_int_distribution<> dis(0, neighboring_empty_positions.size() - 1);
-                pos_t child_position = neighboring_empty_positions[dis(gen)];
-            
-                entity_grid[child_position.i][child_position.j].type = carnivore;
-                entity_grid[child_position.i][child_position.j].energy = 100;
-                entity_grid[child_position.i][child_position.j].age = 0;
-                entity_grid[child_position.i][child_position.j].already_atualized = true;
-
-                entity_grid[i][j].energy = entity_grid[i][j].energy - 10;
-                for (auto it = neighboring_empty_positions.begin(); it != neighboring_empty_positions.end(); ++it) {
-                        if (*it == child_position) {
-                        neighboring_empty_positions.erase(it);
-                        break;  
-                    }
-                }
-            }
-        }
+nlohmann::json simulation_loop_json() {
+    std::lock_guard<std::mutex> lock(simulation_loop.mutex);
+    return {{"running", simulation_loop.running.load()},
+            {"target_rate", simulation_loop.target_rate},
+            {"ticks", simulation_loop.ticks.load(std::memory_order_relaxed)},
+            {"overruns", simulation_loop.overruns.load(std::memory_order_relaxed)},
+            {"late_seconds", simulation_loop.late_ns.load(std::memory_order_relaxed) / 1e9}};
+}
+
+// Prometheus text exposition of the tick phases, the requests, the live entities
+// and the workers
+std::string metrics_text(const worker_pool &workers) {
+    std::string out;
+
+    write_metric_header(out, "ecosim_tick_phase_seconds", "histogram", "Time spent in each phase of an iteration.");
+    for (size_t phase = 0; phase < NUM_TICK_PHASES; phase++) {
+        tick_metrics.phases[phase].write(out, "ecosim_tick_phase_seconds", std::string("phase=\"") + TICK_PHASE_NAMES[phase] + "\"");
     }
+    serialize_latency.write(out, "ecosim_tick_phase_seconds", "phase=\"serialize\"");
 
-    bool age_increased = false;
-
-    // tentativa de se movimentar
-    if (!neighboring_empty_positions.empty()) {
-        bool try_to_move = random_action(CARNIVORE_MOVE_PROBABILITY);
-        if(try_to_move == true) {
-            std::random_device rd;  
-            std::mt19937 gen(rd());  
-            std::uniform_int_distribution<> dis(0, neighboring_empty_positions.size() - 1);
-            pos_t move_position = neighboring_empty_positions[dis(gen)];
-        
-            entity_grid[move_position.i][move_position.j].type = carnivore;
-            entity_grid[move_position.i][move_position.j].energy = entity_grid[i][j].energy - 5;
-            entity_grid[move_position.i][move_position.j].age = entity_grid[i][j].age + 1;
-            entity_grid[move_position.i][move_position.j].already_atualized = true;
-            age_increased = true;
-
-            entity_grid[i][j].type = empty;
-            entity_grid[i][j].energy = 0;
-            entity_grid[i][j].age = 0;
-            
-            if (entity_grid[move_position.i][move_position.j].age == CARNIVORE_MAXIMUM_AGE || entity_grid[move_position.i][move_position.j].energy <= 0) { 
-                entity_grid[move_position.i][move_position.j].type = empty;
-                entity_grid[move_position.i][move_position.j].energy = 0;
-                entity_grid[move_position.i][move_position.j].age = 0;
-            }
-        }
+    write_metric_header(out, "ecosim_ticks_total", "counter", "Iterations computed since the server started.");
+    write_metric_sample(out, "ecosim_ticks_total", "", tick_metrics.ticks.load(std::memory_order_relaxed));
+
+    write_metric_header(out, "ecosim_request_duration_seconds", "histogram", "Time to handle a request, by endpoint.");
+    for (size_t path = 0; path < NUM_TRACKED_PATHS; path++) {
+        request_latency[path].write(out, "ecosim_request_duration_seconds", std::string("path=\"") + TRACKED_PATHS[path] + "\"");
     }
-    if(age_increased == false) {
-        entity_grid[i][j].age += 1;
+
+    write_metric_header(out, "ecosim_response_bytes_total", "counter", "Bytes of response bodies served, by endpoint.");
+    for (size_t path = 0; path < NUM_TRACKED_PATHS; path++) {
+        write_metric_sample(out, "ecosim_response_bytes_total", std::string("path=\"") + TRACKED_PATHS[path] + "\"",
+                            response_bytes[path].load(std::memory_order_relaxed));
     }
 
-    if (entity_grid[i][j].age == CARNIVORE_MAXIMUM_AGE || entity_grid[i][j].energy <= 0) { 
-        entity_grid[i][j].type = empty;
-        entity_grid[i][j].energy = 0;
-        entity_grid[i][j].age = 0;
+    write_metric_header(out, "ecosim_stream_subscribers", "gauge", "Clients connected to the /ws stream.");
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        write_metric_sample(out, "ecosim_stream_subscribers", "", subscribers.size());
+    }
+    write_metric_header(out, "ecosim_stream_frames_total", "counter", "Frames pushed to /ws subscribers.");
+    write_metric_sample(out, "ecosim_stream_frames_total", "", stream_frames.load(std::memory_order_relaxed));
+    write_metric_header(out, "ecosim_stream_bytes_total", "counter", "Bytes of the frames pushed to /ws subscribers.");
+    write_metric_sample(out, "ecosim_stream_bytes_total", "", stream_bytes.load(std::memory_order_relaxed));
+    write_metric_header(out, "ecosim_stream_skipped_total", "counter", "Grid changes not pushed to a /ws subscriber still writing its previous frame.");
+    write_metric_sample(out, "ecosim_stream_skipped_total", "", stream_skipped.load(std::memory_order_relaxed));
+    write_metric_header(out, "ecosim_stream_stalled_total", "counter", "/ws subscribers disconnected for not reading their frames.");
+    write_metric_sample(out, "ecosim_stream_stalled_total", "", stream_stalled.load(std::memory_order_relaxed));
+
+    write_metric_header(out, "ecosim_loop_running", "gauge", "Whether the background loop is advancing the simulation.");
+    write_metric_sample(out, "ecosim_loop_running", "", simulation_loop.running.load());
+    write_metric_header(out, "ecosim_loop_ticks_total", "counter", "Iterations computed by the background loop.");
+    write_metric_sample(out, "ecosim_loop_ticks_total", "", simulation_loop.ticks.load(std::memory_order_relaxed));
+    write_metric_header(out, "ecosim_loop_overruns_total", "counter", "Loop iterations that ended after the next one was due.");
+    write_metric_sample(out, "ecosim_loop_overruns_total", "", simulation_loop.overruns.load(std::memory_order_relaxed));
+    write_metric_header(out, "ecosim_loop_late_seconds_total", "counter", "Time the overrunning iterations ended past their deadline.");
+    write_metric_sample(out, "ecosim_loop_late_seconds_total", "", simulation_loop.late_ns.load(std::memory_order_relaxed) / 1e9);
+
+    write_metric_header(out, "ecosim_live_entities", "gauge", "Live entities of each species after the last iteration.");
+    const std::pair<entity_type_t, const char *> species[] = {{plant, "plants"}, {herbivore, "herbivores"}, {carnivore, "carnivores"}};
+    for (const auto &entry : species) {
+        write_metric_sample(out, "ecosim_live_entities", std::string("species=\"") + entry.second + "\"",
+                            tick_metrics.live_entities[entry.first].load(std::memory_order_relaxed));
     }
 
-    // Libera os mutexes das posições adjacentes
-    printf("terminou carnivoro\n");
+    std::vector<worker_stats_t> stats = workers.stats();
+    write_metric_header(out, "ecosim_worker_utilization", "gauge", "Busy time of each worker over the time spent in parallel sections.");
+    for (size_t worker = 0; worker < stats.size(); worker++) {
+        write_metric_sample(out, "ecosim_worker_utilization", "worker=\"" + std::to_string(worker) + "\"", stats[worker].utilization);
+    }
+    write_metric_header(out, "ecosim_worker_busy_seconds_total", "counter", "Time each worker spent running tasks.");
+    for (size_t worker = 0; worker < stats.size(); worker++) {
+        write_metric_sample(out, "ecosim_worker_busy_seconds_total", "worker=\"" + std::to_string(worker) + "\"", stats[worker].busy_ns / 1e9);
+    }
+    return out;
+}
+
+// Populations after the current iteration
+nlohmann::json population_counts_json() {
+    return {{"tick", simulation_tick()},
+            {"plants", population(plant)},
+            {"herbivores", population(herbivore)},
+            {"carnivores", population(carnivore)}};
+}
+
+// Populations of a published snapshot, in the same form
+nlohmann::json population_counts_json(const grid_snapshot_t &snapshot) {
+    return {{"tick", snapshot.tick},
+            {"plants", snapshot.populations[plant]},
+            {"herbivores", snapshot.populations[herbivore]},
+            {"carnivores", snapshot.populations[carnivore]}};
+}
+
+// Summary of a run_until: why and when it stopped, and each species' population
+nlohmann::json run_summary_json(const run_monitor_t &monitor, stop_reason_t reason) {
+    nlohmann::json populations;
+    const std::pair<entity_type_t, const char *> species[] = {{plant, "plants"}, {herbivore, "herbivores"}, {carnivore, "carnivores"}};
+    for (const auto &entry : species) {
+        const species_summary_t &summary = monitor.species[entry.first];
+        populations[entry.second] = {{"final", population(entry.first)},
+                                     {"minimum", summary.minimum},
+                                     {"maximum", summary.maximum},
+                                     {"mean", monitor.ticks > 0 ? (double)summary.sum / monitor.ticks : 0.0}};
+    }
+
+    nlohmann::json summary = {{"stop_reason", stop_reason_name(reason)},
+                              {"stop_tick", simulation_tick()},
+                              {"ticks_run", monitor.ticks},
+                              {"seconds", monitor.seconds()},
+                              {"populations", populations}};
+    summary["extinct_species"] = monitor.extinct_species == empty ? nlohmann::json() : nlohmann::json(monitor.extinct_species);
+    return summary;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    crow::SimpleApp app;
+    crow::App<request_metrics_t> app;
+
+    // Workers that simulate the entities, created once and reused on every iteration.
+    // Defaults to one per core, the first command line argument overrides it.
+    size_t num_workers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    worker_pool workers(std::max<size_t>(1, num_workers));
+    publish_snapshot();
+
+    // The background loop starts paused; a second argument starts it at that
+    // many iterations per second (0 for as fast as possible)
+    if (argc > 2) {
+        set_simulation_loop(true, std::max(0.0, std::strtod(argv[2], nullptr)));
+    }
+    std::thread loop_thread(run_simulation_loop, std::ref(workers));
+    std::thread broadcast_thread(run_broadcaster);
 
     // Endpoint to serve the HTML page
     CROW_ROUTE(app, "/")
@@ -499,134 +608,420 @@ int main()
         res.end(); });
 
     CROW_ROUTE(app, "/start-simulation")
-        .methods("POST"_method)([](crow::request &req, crow::response &res)
+        .methods("POST"_method)([&workers](crow::request &req, crow::response &res)
                                 { 
         // Parse the JSON request body
         nlohmann::json request_body = nlohmann::json::parse(req.body);
 
        // Validate the request body 
-        uint32_t total_entinties = (uint32_t)request_body["plants"] + (uint32_t)request_body["herbivores"] + (uint32_t)request_body["carnivores"];
-        if (total_entinties > NUM_ROWS * NUM_ROWS) {
+        uint64_t rows = DEFAULT_NUM_ROWS;
+        uint64_t cols = DEFAULT_NUM_COLS;
+        if (!read_unsigned_field(request_body, "rows", UINT32_MAX, rows) || !read_unsigned_field(request_body, "cols", UINT32_MAX, cols) ||
+            rows == 0 || cols == 0 || rows * cols > MAXIMUM_NUM_CELLS) {
+        res.code = 400;
+        res.body = "Invalid grid dimensions";
+        res.end();
+        return;
+        }
+
+        // Each count is checked on its own first, so that a negative or huge one
+        // can't wrap the total around
+        for (const char *field : {"plants", "herbivores", "carnivores"}) {
+        if (!request_body.contains(field) || !request_body[field].is_number_unsigned() ||
+            request_body[field].get<uint64_t>() > rows * cols) {
+        res.code = 400;
+        res.body = std::string("Invalid ") + field;
+        res.end();
+        return;
+        }
+        }
+
+        uint64_t total_entinties = (uint64_t)request_body["plants"] + (uint64_t)request_body["herbivores"] + (uint64_t)request_body["carnivores"];
+        if (total_entinties > rows * cols) {
         res.code = 400;
         res.body = "Too many entities";
         res.end();
         return;
         }
 
-        // Clear the entity grid
-        entity_grid.clear();
-        entity_grid.assign(NUM_ROWS, std::vector<entity_t>(NUM_ROWS, { empty, 0, 0, false}));
-        
-        // Create the entities
-        for(int i = 0; i < (uint32_t)request_body["plants"]; i++) {
-            static std::random_device rd; // Inicializa a random_device para obter sementes aleatórias
-            static std::mt19937 gen(rd()); // Usa a random_device para inicializar um gerador de números pseudoaleatórios
-            std::uniform_int_distribution<> dis(0, 14); //Gera um número aleatório no intervalo definido
-            int rand_row = dis(gen);
-            int rand_col = dis(gen);
-
-            while(entity_grid[rand_row][rand_col].type != empty){
-                rand_row = dis(gen);
-                rand_col = dis(gen);
-            }
-            
-            entity_grid[rand_row][rand_col].type = plant;
-            entity_grid[rand_row][rand_col].age = 0; 
+        // Without a seed the run is still reproducible from the one reported back
+        uint64_t seed = ((uint64_t)std::random_device()() << 32) | std::random_device()();
+        if (!read_unsigned_field(request_body, "seed", UINT64_MAX, seed)) {
+        res.code = 400;
+        res.body = "Invalid seed";
+        res.end();
+        return;
         }
 
-        for(int i = 0; i < (uint32_t)request_body["herbivores"]; i++) {
-            static std::random_device rd; 
-            static std::mt19937 gen(rd()); 
-            std::uniform_int_distribution<> dis(0, 14); 
-            int rand_row = dis(gen);
-            int rand_col = dis(gen);
+        // A given seed defaults to a mode that reproduces it with any number of workers
+        bool seeded = request_body.contains("seed");
+        tick_mode_t mode = seeded ? SEEDED_TICK_MODE : tick_in_place;
+        if (request_body.contains("mode") && (!request_body["mode"].is_string() || !parse_tick_mode(request_body["mode"].get<std::string>(), mode))) {
+        res.code = 400;
+        res.body = "Invalid mode";
+        res.end();
+        return;
+        }
+        if (seeded && !tick_mode_is_deterministic(mode) && workers.size() > 1) {
+            LOG_WARN("mode %s with %zu workers doesn't reproduce seed %llu exactly",
+                     TICK_MODE_NAMES[mode].first, workers.size(), (unsigned long long)seed);
+        }
 
-            while(entity_grid[rand_row][rand_col].type != empty){
-                rand_row = dis(gen);
-                rand_col = dis(gen);
-            }
-            
-            entity_grid[rand_row][rand_col].type = herbivore;
-            entity_grid[rand_row][rand_col].age = 0; 
-            entity_grid[rand_row][rand_col].energy = 100; 
-        }
-
-        for(int i = 0; i < (uint32_t)request_body["carnivores"]; i++) {
-            static std::random_device rd; 
-            static std::mt19937 gen(rd()); 
-            std::uniform_int_distribution<> dis(0, 14); 
-            int rand_row = dis(gen);
-            int rand_col = dis(gen);
-
-            while(entity_grid[rand_row][rand_col].type != empty){
-                rand_row = dis(gen);
-                rand_col = dis(gen);
-            }
-            
-            entity_grid[rand_row][rand_col].type = carnivore;
-            entity_grid[rand_row][rand_col].age = 0; 
-            entity_grid[rand_row][rand_col].energy = 100; 
+        // Restart the simulation with the new grid and populations
+        simulation_config_t config;
+        config.rows = rows;
+        config.cols = cols;
+        config.mode = mode;
+        config.seed = seed;
+        config.plants = request_body["plants"];
+        config.herbivores = request_body["herbivores"];
+        config.carnivores = request_body["carnivores"];
+        snapshot_ref_t snapshot;
+        {
+        std::lock_guard<std::mutex> lock(simulation_mutex);
+        start_simulation(config);
+        snapshot = publish_snapshot();
         }
+        LOG_INFO("simulation started: %ux%u grid, %u plants, %u herbivores, %u carnivores, mode %s, seed %llu",
+                 config.rows, config.cols, config.plants, config.herbivores, config.carnivores,
+                 TICK_MODE_NAMES[mode].first, (unsigned long long)seed);
 
         // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        res.body = json_grid.dump();
+        nlohmann::json json_grid = snapshot->grid;
+        res.set_header("X-Simulation-Seed", std::to_string(seed));
+        res.set_header("X-Simulation-Mode", TICK_MODE_NAMES[mode].first);
+        res.set_header("X-Simulation-Run", std::to_string(snapshot->run));
+        res.body = serialize_grid(json_grid);
+        queue_broadcast(snapshot);
         res.end(); });
 
     // Endpoint to process HTTP GET requests for the next simulation iteration
+    // Each request advances one iteration, unless the background loop is running:
+    // then it only returns the latest grid, and steps is refused.
+    // The optional steps parameter advances several iterations in one request and
+    // serializes only the last grid; with counts=1 the response becomes an object
+    // with the grid and the populations after each iteration (or after every k-th
+    // one and the last, when there are more than MAXIMUM_POPULATION_SAMPLES of
+    // them; each sample carries its tick). format=bin returns
+    // the grid as a packed binary frame instead of JSON.
+    // A client that already holds the grid of some tick passes it as since=T
+    // together with the run it belongs to, and gets only the cells changed after
+    // it; the response falls back to the full grid when that isn't possible.
     CROW_ROUTE(app, "/next-iteration")
-        .methods("GET"_method)([]()
+        .methods("GET"_method)([&workers](const crow::request &req, crow::response &res)
                                {
-        // Simulate the next iteration
-        // Iterate over the entity grid and simulate the behaviour of each entity
-        for (int i=0; i<15; i++) {
-            for (int j=0; j<15; j++) {
-                entity_grid[i][j].already_atualized = false;
+        uint64_t steps = 1;
+        const char *steps_param = req.url_params.get("steps");
+        if (steps_param != nullptr && !parse_positive_param(steps_param, MAXIMUM_STEPS_PER_REQUEST, steps)) {
+        res.code = 400;
+        res.body = "Invalid steps";
+        res.end();
+        return;
+        }
+        const char *counts_param = req.url_params.get("counts");
+        bool with_counts = counts_param != nullptr && std::string(counts_param) == "1";
+        const char *format_param = req.url_params.get("format");
+        bool binary = format_param != nullptr && std::string(format_param) == "bin";
+        if ((format_param != nullptr && !binary && std::string(format_param) != "json") || (binary && with_counts)) {
+        res.code = 400;
+        res.body = "Invalid format";
+        res.end();
+        return;
+        }
+        const char *since_param = req.url_params.get("since");
+        const char *run_param = req.url_params.get("run");
+        uint64_t base_tick = 0;
+        uint64_t run = 0;
+        if ((since_param == nullptr) != (run_param == nullptr) ||
+            (since_param != nullptr && (!parse_unsigned_param(since_param, UINT32_MAX, base_tick) || !parse_unsigned_param(run_param, UINT32_MAX, run)))) {
+        res.code = 400;
+        res.body = "Invalid since or run";
+        res.end();
+        return;
+        }
+
+        // While the background loop is running it alone advances the simulation:
+        // asking for steps is a conflict, and a plain request only reads the latest
+        // snapshot without taking any lock
+        if (simulation_loop.running.load()) {
+            if (steps_param != nullptr) {
+            res.code = 409;
+            res.body = "Simulation loop is running";
+            res.end();
+            return;
             }
+            steps = 0;
         }
 
-        std::vector<std::thread> threads;
-        for (int i = 0; i < NUM_ROWS; i++) {
-            for (int j = 0; j < NUM_ROWS; j++) {
-                if (!entity_grid[i][j].already_atualized) {
-                    if (entity_grid[i][j].type == plant) {
-                        threads.emplace_back(simul_plant, i, j);
-                        printf("criou a thread da planta\n");
-                    }
-                    else if (entity_grid[i][j].type == herbivore) {
-                        threads.emplace_back(simul_herbivore, i, j);
-                        printf("criou a thread do herbivoro\n");
-                    }
-                    else if (entity_grid[i][j].type == carnivore) {
-                        threads.emplace_back(simul_carnivore, i, j);
-                        printf("criou a thread do carnivoro\n");
-                    }
+        // Simulate the next iterations
+        nlohmann::json populations = nlohmann::json::array();
+        snapshot_ref_t snapshot;
+        if (steps > 0) {
+            {
+            std::lock_guard<std::mutex> lock(simulation_mutex);
+            uint64_t sample_every = (steps + MAXIMUM_POPULATION_SAMPLES - 1) / MAXIMUM_POPULATION_SAMPLES;
+            for (uint64_t step = 0; step < steps; step++) {
+                next_iteration(workers);
+                if (with_counts && ((step + 1) % sample_every == 0 || step + 1 == steps)) {
+                    populations.push_back(population_counts_json());
                 }
             }
+            snapshot = publish_snapshot();
+            }
+            queue_broadcast(snapshot);
+        }
+        else {
+            snapshot = latest_snapshot();
+            if (with_counts) {
+                populations.push_back(population_counts_json(*snapshot));
+            }
+        }
+
+        // The response is encoded from the snapshot, while the next iterations run
+        std::vector<uint32_t> cells;
+        bool delta = since_param != nullptr && delta_cells(*snapshot, run, base_tick, cells);
+        res.set_header("X-Simulation-Run", std::to_string(snapshot->run));
+        if (binary) {
+            res.set_header("Content-Type", "application/octet-stream");
+            res.body = serialize_grid_binary(*snapshot, delta, cells, base_tick);
+            res.end();
+            return;
+        }
+
+        // Return the JSON representation of the entity grid, or with since an
+        // object with either the changed cells or the whole grid
+        nlohmann::json json_grid;
+        if (since_param != nullptr) {
+            json_grid = grid_update_json(*snapshot, delta, cells, base_tick);
+        }
+        else {
+            json_grid = snapshot->grid;
+            if (with_counts) {
+                json_grid = {{"grid", std::move(json_grid)}};
+            }
         }
+        if (with_counts) {
+            json_grid["populations"] = std::move(populations);
+        }
+        res.body = serialize_grid(json_grid);
+        res.end(); });
 
-        threads_created = true;
-        int i=0;
-        printf("acordou todas\n");        
-        cv.notify_all();
-        
-        for (auto& thread : threads) {
-        printf("join thread %d\n", i);
-        thread.join();
-        i++;
-        }      
-        
+    // Keeps iterating until a species dies out, the total population settles or a
+    // budget runs out, and returns the stopping tick with the population statistics
+    CROW_ROUTE(app, "/run-until")
+        .methods("POST"_method)([&workers](const crow::request &req, crow::response &res)
+                               {
+        nlohmann::json request_body = req.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(req.body, nullptr, false);
+        if (!request_body.is_object()) {
+        res.code = 400;
+        res.body = "Invalid body";
+        res.end();
+        return;
+        }
 
+        stop_conditions_t conditions;
+        uint64_t steady_ticks = 0;
+        bool include_grid = false;
+        conditions.max_ticks = MAXIMUM_STEPS_PER_REQUEST;
+        if (!read_bool_field(request_body, "extinction", conditions.extinction) ||
+            !read_non_negative_field(request_body, "steady_epsilon", conditions.steady_epsilon) ||
+            !read_unsigned_field(request_body, "steady_ticks", UINT32_MAX, steady_ticks) ||
+            !read_unsigned_field(request_body, "max_ticks", MAXIMUM_STEPS_PER_REQUEST, conditions.max_ticks) ||
+            !read_non_negative_field(request_body, "max_seconds", conditions.max_seconds) ||
+            !read_bool_field(request_body, "grid", include_grid) || conditions.max_ticks == 0) {
+        res.code = 400;
+        res.body = "Invalid stop conditions";
+        res.end();
+        return;
+        }
+        conditions.steady_ticks = steady_ticks;
 
+        if (simulation_loop.running.load()) {
+        res.code = 409;
+        res.body = "Simulation loop is running";
+        res.end();
+        return;
+        }
 
+        nlohmann::json summary;
+        snapshot_ref_t snapshot;
+        {
+        std::lock_guard<std::mutex> lock(simulation_mutex);
+        run_monitor_t monitor(conditions);
+        stop_reason_t reason = run_until(workers, monitor);
+        summary = run_summary_json(monitor, reason);
+        snapshot = publish_snapshot();
+        }
+        queue_broadcast(snapshot);
 
+        if (include_grid) {
+            summary["grid"] = snapshot->grid;
+        }
+        res.body = summary.dump();
+        res.end(); });
 
+    // Stream of the grid over a WebSocket: a frame is pushed whenever the grid
+    // changes, with the format of a /next-iteration response with since (JSON
+    // text or binary frames). A client configures its stream with the text
+    // message {"format": "json" or "bin", "delta": true or false}, which is
+    // answered with a full frame, and may advance the simulation itself with
+    // {"steps": N}.
+    CROW_ROUTE(app, "/ws")
+        .websocket()
+        .onopen([](crow::websocket::connection &connection)
+                {
+        auto &socket = static_cast<crow::websocket::Connection<crow::SocketAdaptor> &>(connection);
+        uint64_t id;
+        {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        id = subscribers[&connection].id = ++next_subscriber_id;
+        }
+        socket.drain_handler([&socket, id] { subscriber_drained(socket, id); });
+        // The first frame is encoded by the broadcaster like any other
+        queue_broadcast(latest_snapshot()); })
+        .onclose([](crow::websocket::connection &connection, const std::string &)
+                 {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        subscribers.erase(&connection); })
+        .onmessage([&workers](crow::websocket::connection &connection, const std::string &data, bool is_binary)
+                   {
+        nlohmann::json message = is_binary ? nlohmann::json() : nlohmann::json::parse(data, nullptr, false);
+        if (!message.is_object()) {
+            connection.send_text(R"({"error":"Invalid message"})");
+            return;
+        }
 
+        if (message.contains("steps")) {
+            uint64_t steps = message["steps"].is_number_unsigned() ? message["steps"].get<uint64_t>() : 0;
+            if (steps == 0 || steps > MAXIMUM_STEPS_PER_REQUEST) {
+                connection.send_text(R"({"error":"Invalid steps"})");
+                return;
+            }
+            if (simulation_loop.running.load()) {
+                connection.send_text(R"({"error":"Simulation loop is running"})");
+                return;
+            }
+            snapshot_ref_t snapshot;
+            {
+                std::lock_guard<std::mutex> simulation_lock(simulation_mutex);
+                for (uint64_t step = 0; step < steps; step++) {
+                    next_iteration(workers);
+                }
+                snapshot = publish_snapshot();
+            }
+            queue_broadcast(snapshot);
+            return;
+        }
 
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        return json_grid.dump(); });
+        {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        auto subscriber = subscribers.find(&connection);
+        if (subscriber == subscribers.end()) {
+            return;
+        }
+        std::string format = subscriber->second.binary ? "bin" : "json";
+        if (message.contains("format")) {
+            format = message["format"].is_string() ? message["format"].get<std::string>() : "";
+        }
+        if ((format != "bin" && format != "json") || (message.contains("delta") && !message["delta"].is_boolean())) {
+            connection.send_text(R"({"error":"Invalid format"})");
+            return;
+        }
+        subscriber->second.binary = format == "bin";
+        subscriber->second.delta = message.value("delta", subscriber->second.delta);
+        subscriber->second.has_frame = false;
+        }
+        queue_broadcast(latest_snapshot()); });
+
+    // Control of the background loop. /resume takes an optional {"rate": R} with
+    // the target iterations per second, 0 for as fast as possible.
+    CROW_ROUTE(app, "/pause")
+        .methods("POST"_method)([]()
+                                {
+        set_simulation_loop(false, -1);
+        return simulation_loop_json().dump(); });
+
+    CROW_ROUTE(app, "/resume")
+        .methods("POST"_method)([](const crow::request &req, crow::response &res)
+                                {
+        nlohmann::json request_body = req.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(req.body, nullptr, false);
+        double rate = -1;
+        if (request_body.is_object() && request_body.contains("rate")) {
+            rate = request_body["rate"].is_number() ? request_body["rate"].get<double>() : -1;
+            if (rate < 0) {
+            res.code = 400;
+            res.body = "Invalid rate";
+            res.end();
+            return;
+            }
+        }
+        else if (!request_body.is_object()) {
+        res.code = 400;
+        res.body = "Invalid body";
+        res.end();
+        return;
+        }
+        set_simulation_loop(true, rate);
+        res.body = simulation_loop_json().dump();
+        res.end(); });
+
+    CROW_ROUTE(app, "/loop")
+        .methods("GET"_method)([]()
+                               { return simulation_loop_json().dump(); });
+
+    // Population counts, total energy and age histogram of each species, read from
+    // the totals the engine keeps up to date instead of walking the grid. They come
+    // from the latest snapshot, so the request never waits for an iteration.
+    CROW_ROUTE(app, "/stats")
+        .methods("GET"_method)([]()
+                               {
+        snapshot_ref_t snapshot = latest_snapshot();
+        const population_stats_t &stats = snapshot->stats;
+
+        nlohmann::json populations;
+        const std::pair<entity_type_t, const char *> species[] = {{plant, "plants"}, {herbivore, "herbivores"}, {carnivore, "carnivores"}};
+        for (const auto &entry : species) {
+            populations[entry.second] = {{"count", snapshot->populations[entry.first]},
+                                         {"total_energy", stats.energy[entry.first]},
+                                         {"age_histogram", stats.age_histogram[entry.first]}};
+        }
+        nlohmann::json json_stats = {{"tick", snapshot->tick}, {"age_bucket_width", AGE_BUCKET_WIDTH}, {"populations", populations}};
+        return json_stats.dump(); });
+
+    // Prometheus scrape endpoint. Everything it reads is recorded with atomics, so it
+    // doesn't wait for a running iteration.
+    CROW_ROUTE(app, "/metrics")
+        .methods("GET"_method)([&workers](const crow::request &, crow::response &res)
+                               {
+        res.set_header("Content-Type", "text/plain; version=0.0.4");
+        res.body = metrics_text(workers);
+        res.end(); });
+
+    // Endpoint that reports how busy each worker has been, to check the load balance
+    CROW_ROUTE(app, "/worker-stats")
+        .methods("GET"_method)([&workers]()
+                               {
+        nlohmann::json json_stats = nlohmann::json::array();
+        for (const worker_stats_t &worker : workers.stats()) {
+            json_stats.push_back({{"busy_seconds", worker.busy_ns / 1e9},
+                                  {"tasks", worker.tasks},
+                                  {"steals", worker.steals},
+                                  {"utilization", worker.utilization}});
+        }
+        return json_stats.dump(); });
     app.port(8080).run();
 
+    {
+        std::lock_guard<std::mutex> lock(simulation_loop.mutex);
+        simulation_loop.stopping = true;
+    }
+    simulation_loop.wakeup.notify_all();
+    loop_thread.join();
+    {
+        std::lock_guard<std::mutex> lock(stream_broadcaster.mutex);
+        stream_broadcaster.stopping = true;
+    }
+    stream_broadcaster.wakeup.notify_all();
+    broadcast_thread.join();
     return 0;
 }
\ No newline at end of file
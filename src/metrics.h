@@ -0,0 +1,89 @@
+#ifndef ECOSIM_METRICS_H
+#define ECOSIM_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Latency histogram with fixed bucket bounds. Recording is a couple of relaxed
+// atomic increments, so it can sit on the hot path of every tick and request
+// without any locking; readers may see a sample counted in the buckets but not
+// yet in the sum, which Prometheus tolerates.
+class latency_histogram_t
+{
+public:
+    // Upper bounds of the buckets, from 1 µs to 10 s
+    static constexpr uint64_t BUCKET_BOUNDS_NS[] = {
+        1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+        1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+        1000000000, 2500000000, 5000000000, 10000000000};
+    static constexpr size_t NUM_BUCKETS = sizeof(BUCKET_BOUNDS_NS) / sizeof(BUCKET_BOUNDS_NS[0]);
+
+    void record(uint64_t ns)
+    {
+        size_t bucket = 0;
+        while (bucket < NUM_BUCKETS && ns > BUCKET_BOUNDS_NS[bucket]) {
+            bucket++;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // Appends the histogram in Prometheus text format. labels is either empty or
+    // a list of name="value" pairs without the braces.
+    void write(std::string &out, const char *name, const std::string &labels) const
+    {
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        uint64_t cumulative = 0;
+        char line[256];
+        for (size_t bucket = 0; bucket <= NUM_BUCKETS; bucket++) {
+            cumulative += buckets[bucket].load(std::memory_order_relaxed);
+            if (bucket < NUM_BUCKETS) {
+                snprintf(line, sizeof(line), "%s_bucket{%sle=\"%g\"} %llu\n", name, prefix.c_str(),
+                         BUCKET_BOUNDS_NS[bucket] / 1e9, (unsigned long long)cumulative);
+            }
+            else {
+                snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %llu\n", name, prefix.c_str(), (unsigned long long)cumulative);
+            }
+            out += line;
+        }
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        snprintf(line, sizeof(line), "%s_sum%s %.9f\n%s_count%s %llu\n", name, braces.c_str(),
+                 sum_ns.load(std::memory_order_relaxed) / 1e9, name, braces.c_str(), (unsigned long long)cumulative);
+        out += line;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[NUM_BUCKETS + 1] = {}; // the last one is +Inf
+    std::atomic<uint64_t> sum_ns{0};
+};
+
+// Appends the HELP and TYPE lines that precede the samples of a metric
+inline void write_metric_header(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+// Appends one sample of a counter or gauge
+inline void write_metric_sample(std::string &out, const char *name, const std::string &labels, double value)
+{
+    char line[256];
+    if (labels.empty()) {
+        snprintf(line, sizeof(line), "%s %.17g\n", name, value);
+    }
+    else {
+        snprintf(line, sizeof(line), "%s{%s} %.17g\n", name, labels.c_str(), value);
+    }
+    out += line;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef ECOSIM_RANDOM_H
+#define ECOSIM_RANDOM_H
+
+#include <cstdint>
+
+// Step of the splitmix64 generator, used to expand one seed into the state of
+// the other generators
+inline uint64_t splitmix64(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// xoshiro256** generator: 32 bytes of state and a handful of shifts and
+// multiplications per draw
+class xoshiro256_t
+{
+public:
+    explicit xoshiro256_t(uint64_t seed = 0) { this->seed(seed); }
+
+    void seed(uint64_t seed)
+    {
+        for (uint64_t &word : state) {
+            word = splitmix64(seed);
+        }
+    }
+
+    uint64_t next()
+    {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Uniform draw in [0, size)
+    uint32_t below(uint32_t size) { return (uint32_t)(((next() >> 32) * size) >> 32); }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t state[4];
+};
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3"). Each block of 4 random words is a pure
+// function of a 128-bit counter and a 64-bit key, so any draw can be computed
+// on its own, by any thread, in any order.
+struct philox_block_t
+{
+    uint32_t words[4];
+};
+
+inline philox_block_t philox4x32(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint64_t key)
+{
+    uint32_t k0 = (uint32_t)key;
+    uint32_t k1 = (uint32_t)(key >> 32);
+    for (int round = 0; round < 10; round++) {
+        uint64_t product0 = (uint64_t)0xD2511F53 * c0;
+        uint64_t product1 = (uint64_t)0xCD9E8D57 * c2;
+        uint32_t next0 = (uint32_t)(product1 >> 32) ^ c1 ^ k0;
+        uint32_t next2 = (uint32_t)(product0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)product1;
+        c3 = (uint32_t)product0;
+        c0 = next0;
+        c2 = next2;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    return {{c0, c1, c2, c3}};
+}
+
+// Maps a random word to [0, 1)
+inline double uniform_word(uint32_t word) { return word * 0x1.0p-32; }
+
+// Maps a random word to [0, size), by multiply-shift instead of a division
+inline uint32_t bounded_word(uint32_t word, uint32_t size) { return (uint32_t)(((uint64_t)word * size) >> 32); }
+
+#endif
@@ -0,0 +1,1346 @@
+#include "simulation.h"
+#include "logger.h"
+#include "random.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
+// Constants
+const uint32_t PLANT_MAXIMUM_AGE = 10;
+const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
+const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
+const uint32_t MAXIMUM_ENERGY = 200;
+const int32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
+
+// Probabilities
+const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
+const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
+const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
+const double HERBIVORE_MOVE_PROBABILITY = 0.7;
+const double HERBIVORE_EAT_PROBABILITY = 0.9;
+const double CARNIVORE_MOVE_PROBABILITY = 0.5;
+const double CARNIVORE_EAT_PROBABILITY = 1.0;
+
+// Marks the absence of a cell index
+const uint32_t NO_CELL = UINT32_MAX;
+
+bool parse_tick_mode(const std::string &name, tick_mode_t &mode) {
+    for (const auto &entry : TICK_MODE_NAMES) {
+        if (name == entry.first) {
+            mode = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool tick_mode_is_deterministic(tick_mode_t mode) {
+    return mode == tick_checkerboard || mode == tick_double_buffered;
+}
+
+// Actions proposed by an entity during a double-buffered iteration (NO_CELL if not taken)
+struct intent_t
+{
+    uint32_t eat_target = NO_CELL;
+    uint32_t child_target = NO_CELL;
+    uint32_t move_target = NO_CELL;
+};
+
+entity_grid_t entity_grid;
+static tick_mode_t tick_mode = tick_in_place;
+
+// Proposals made during a double-buffered iteration, NO_CELL everywhere else
+static std::vector<intent_t> intents;
+
+// Cells holding live entities, one list per species (indexed by entity_type_t),
+// so an iteration costs O(live entities) instead of O(cells). The lists are
+// brought up to date after each iteration from the cells written during it.
+static std::vector<uint32_t> live_cells[4];
+static std::vector<uint32_t> live_slot;        // position of each listed cell in its list
+static std::vector<entity_type_t> listed_type; // list each cell is in, empty if none
+
+// Cells written during the current iteration, one log per worker
+static std::vector<std::vector<uint32_t>> dirty_cells;
+
+// Lists of written cells that neither the history nor any snapshot holds any
+// more, kept with their capacity for the next iterations. A list is freed by
+// whichever thread drops it last. Each iteration needs one list and frees about
+// one, so only a few are kept.
+const size_t MAXIMUM_SPARE_CHANGES = 8;
+static std::mutex spare_changes_mutex;
+static std::vector<std::unique_ptr<std::vector<uint32_t>>> spare_changes;
+
+void recycle_changes(std::vector<uint32_t> *changes) {
+    std::unique_ptr<std::vector<uint32_t>> owned(changes);
+    owned->clear();
+    std::lock_guard<std::mutex> lock(spare_changes_mutex);
+    if (spare_changes.size() < MAXIMUM_SPARE_CHANGES) {
+        spare_changes.push_back(std::move(owned));
+    }
+}
+
+std::shared_ptr<std::vector<uint32_t>> new_changes() {
+    std::vector<uint32_t> *changes = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(spare_changes_mutex);
+        if (!spare_changes.empty()) {
+            changes = spare_changes.back().release();
+            spare_changes.pop_back();
+        }
+    }
+    return std::shared_ptr<std::vector<uint32_t>>(changes != nullptr ? changes : new std::vector<uint32_t>(), recycle_changes);
+}
+
+// Cells written during each of the last DELTA_HISTORY_TICKS iterations, indexed
+// by tick modulo DELTA_HISTORY_TICKS. Snapshots share these lists, so a list
+// still held by one is replaced by a spare one instead of overwritten.
+static std::shared_ptr<std::vector<uint32_t>> changed_cells[DELTA_HISTORY_TICKS];
+
+// Energy and age of each listed cell as last counted in population_totals, so
+// a cell written during an iteration can take back its old contribution
+static std::vector<int16_t> counted_energy;
+static std::vector<int16_t> counted_age;
+static population_stats_t population_totals;
+
+// Changes to population_totals made by one worker during an iteration, padded so
+// that workers never write to the same cache line
+struct alignas(64) stats_accumulator_t
+{
+    population_stats_t delta;
+};
+
+static std::vector<stats_accumulator_t> stats_accumulators;
+
+uint32_t age_bucket(int32_t age) {
+    return std::min<uint32_t>(age / AGE_BUCKET_WIDTH, NUM_AGE_BUCKETS - 1);
+}
+
+void count_entity(population_stats_t &stats, entity_type_t type, int32_t energy, int32_t age, int64_t sign) {
+    stats.energy[type] += sign * energy;
+    stats.age_histogram[type][age_bucket(age)] += sign;
+}
+
+void list_cell(uint32_t idx, entity_type_t type) {
+    live_slot[idx] = live_cells[type].size();
+    listed_type[idx] = type;
+    live_cells[type].push_back(idx);
+}
+
+void unlist_cell(uint32_t idx) {
+    std::vector<uint32_t> &cells = live_cells[listed_type[idx]];
+    uint32_t last = cells.back();
+    cells[live_slot[idx]] = last;
+    live_slot[last] = live_slot[idx];
+    cells.pop_back();
+    listed_type[idx] = empty;
+}
+
+void rebuild_live_cells() {
+    for (auto &cells : live_cells) {
+        cells.clear();
+    }
+    live_slot.assign(entity_grid.size(), NO_CELL);
+    listed_type.assign(entity_grid.size(), empty);
+    counted_energy = entity_grid.energy;
+    counted_age = entity_grid.age;
+    population_totals = population_stats_t();
+    for (uint32_t idx = 0; idx < entity_grid.size(); idx++) {
+        if (entity_grid.type[idx] != empty) {
+            list_cell(idx, entity_grid.type[idx]);
+            count_entity(population_totals, entity_grid.type[idx], entity_grid.energy[idx], entity_grid.age[idx], 1);
+        }
+    }
+}
+
+// Brings the live lists and population_totals up to date with the cells written
+// during the iteration and clears their already_atualized flag for the next one.
+// Every cell appears in at most one log, so the logs are counted in parallel
+// and only the changes of species are applied serially. The logs are then moved
+// into the history of the given tick.
+void update_live_cells(worker_pool &workers, uint32_t tick) {
+    stats_accumulators.assign(workers.size(), stats_accumulator_t());
+    workers.parallel_for(dirty_cells.size(), [](size_t worker, size_t begin, size_t end) {
+        population_stats_t &delta = stats_accumulators[worker].delta;
+        for (size_t w = begin; w < end; w++) {
+            for (uint32_t idx : dirty_cells[w]) {
+                entity_grid.already_atualized[idx] = false;
+                if (listed_type[idx] != empty) {
+                    count_entity(delta, listed_type[idx], counted_energy[idx], counted_age[idx], -1);
+                }
+                if (entity_grid.type[idx] != empty) {
+                    count_entity(delta, entity_grid.type[idx], entity_grid.energy[idx], entity_grid.age[idx], 1);
+                }
+                counted_energy[idx] = entity_grid.energy[idx];
+                counted_age[idx] = entity_grid.age[idx];
+            }
+        }
+    }, 1);
+
+    for (const stats_accumulator_t &accumulator : stats_accumulators) {
+        for (entity_type_t type : {plant, herbivore, carnivore}) {
+            population_totals.energy[type] += accumulator.delta.energy[type];
+            for (uint32_t bucket = 0; bucket < NUM_AGE_BUCKETS; bucket++) {
+                population_totals.age_histogram[type][bucket] += accumulator.delta.age_histogram[type][bucket];
+            }
+        }
+    }
+
+    std::shared_ptr<std::vector<uint32_t>> &history = changed_cells[tick % DELTA_HISTORY_TICKS];
+    if (!history || history.use_count() > 1) {
+        history = new_changes();
+    }
+    std::vector<uint32_t> &changes = *history;
+    changes.clear();
+    for (auto &dirty : dirty_cells) {
+        for (uint32_t idx : dirty) {
+            if (listed_type[idx] != entity_grid.type[idx]) {
+                if (listed_type[idx] != empty) {
+                    unlist_cell(idx);
+                }
+                if (entity_grid.type[idx] != empty) {
+                    list_cell(idx, entity_grid.type[idx]);
+                }
+            }
+        }
+        changes.insert(changes.end(), dirty.begin(), dirty.end());
+        dirty.clear();
+    }
+}
+
+// All the cells holding live entities, in row-major order
+std::vector<uint32_t> sorted_live_cells() {
+    std::vector<uint32_t> cells;
+    cells.reserve(live_cells[plant].size() + live_cells[herbivore].size() + live_cells[carnivore].size());
+    for (entity_type_t species : {plant, herbivore, carnivore}) {
+        cells.insert(cells.end(), live_cells[species].begin(), live_cells[species].end());
+    }
+    std::sort(cells.begin(), cells.end());
+    return cells;
+}
+
+// Seed of the current simulation and number of iterations computed so far. Every
+// random draw is a function of (seed, tick, cell, action) alone, so the outcome
+// doesn't depend on which worker makes the draw or when.
+static uint64_t simulation_seed;
+static uint32_t current_tick;
+static uint32_t current_run;
+
+// Actions an entity draws random numbers for
+enum random_draw_t : uint32_t
+{
+    draw_eat,
+    draw_reproduce,
+    draw_move
+};
+
+// Random words of the entity at idx for one of its actions in the current tick:
+// the first decides whether the action happens, the second picks its target
+philox_block_t random_draw(uint32_t idx, random_draw_t action) {
+    return philox4x32(current_tick, idx, action, 0, simulation_seed);
+}
+
+bool random_action(const philox_block_t &draw, float probability) {
+    return uniform_word(draw.words[0]) < probability;
+}
+
+// Small fixed-capacity list of cell indices, enough for the 4 von Neumann neighbours
+struct cell_list_t
+{
+    uint32_t cells[4];
+    uint32_t count = 0;
+
+    bool empty() const { return count == 0; }
+    void push_back(uint32_t idx) { cells[count++] = idx; }
+    void clear() { count = 0; }
+    void erase(uint32_t idx)
+    {
+        for (uint32_t k = 0; k < count; k++) {
+            if (cells[k] == idx) {
+                cells[k] = cells[--count];
+                return;
+            }
+        }
+    }
+    uint32_t random(const philox_block_t &draw) const { return cells[bounded_word(draw.words[1], count)]; }
+};
+
+// Stores the neighbours of idx (below, above, right, left) that are inside the
+// grid and returns how many there are
+uint32_t neighbour_cells(uint32_t idx, uint32_t neighbours[4]) {
+    uint32_t i = idx / entity_grid.num_cols;
+    uint32_t j = idx % entity_grid.num_cols;
+    uint32_t count = 0;
+
+    if (i + 1 < entity_grid.num_rows) neighbours[count++] = idx + entity_grid.num_cols;
+    if (i > 0) neighbours[count++] = idx - entity_grid.num_cols;
+    if (j + 1 < entity_grid.num_cols) neighbours[count++] = idx + 1;
+    if (j > 0) neighbours[count++] = idx - 1;
+    return count;
+}
+
+// Read access to the cells of entity_grid
+struct grid_reader_t
+{
+    entity_type_t type(uint32_t idx) const { return entity_grid.type[idx]; }
+};
+
+// Access to the cells of entity_grid used by the in-place entity updates. Reads
+// and writes go straight to the grid; the caller guarantees that no other worker
+// touches the neighbourhood at the same time (striped locks, checkerboard).
+struct grid_access_t : grid_reader_t
+{
+    std::vector<uint32_t> &dirty; // cells written by this worker
+
+    explicit grid_access_t(std::vector<uint32_t> &dirty) : dirty(dirty) {}
+
+    // Flags a cell as updated in this iteration, logging it the first time
+    void touch(uint32_t idx)
+    {
+        if (!entity_grid.already_atualized[idx]) {
+            entity_grid.already_atualized[idx] = true;
+            dirty.push_back(idx);
+        }
+    }
+
+    // Puts an offspring into a neighbouring cell
+    void place(uint32_t idx, entity_type_t type, int32_t energy, int32_t age)
+    {
+        entity_grid.set(idx, type, energy, age);
+        touch(idx);
+    }
+
+    // Moves the entity of from into a neighbouring cell, with its new energy and age
+    void move(uint32_t from, uint32_t to, entity_type_t type, int32_t energy, int32_t age)
+    {
+        entity_grid.clear(from);
+        touch(from);
+        place(to, type, energy, age);
+    }
+
+    // Removes the entity of a neighbouring cell that has been eaten
+    void remove(uint32_t idx)
+    {
+        entity_grid.clear(idx);
+        touch(idx);
+    }
+
+    // The animal at eater eats the entity of a neighbouring cell and gains energy.
+    // Returns whether the meal took place now; see strip_access_t for when it doesn't.
+    bool eat(uint32_t eater, uint32_t prey, int32_t energy)
+    {
+        remove(prey);
+        feed(eater, energy);
+        return true;
+    }
+
+    void feed(uint32_t idx, int32_t energy)
+    {
+        entity_grid.energy[idx] = std::min<int32_t>(entity_grid.energy[idx] + energy, MAXIMUM_ENERGY);
+        touch(idx);
+    }
+};
+
+// Collects the neighbours of idx that are empty and the ones that hold prey_type
+template <typename access_t>
+void scan_neighbours(const access_t &access, uint32_t idx, entity_type_t prey_type, cell_list_t &empty_cells, cell_list_t &prey_cells) {
+    uint32_t neighbours[4];
+    uint32_t count = neighbour_cells(idx, neighbours);
+
+    for (uint32_t k = 0; k < count; k++) {
+        entity_type_t neighbour_type = access.type(neighbours[k]);
+        if (neighbour_type == empty) {
+            empty_cells.push_back(neighbours[k]);
+        }
+        else if (neighbour_type == prey_type) {
+            prey_cells.push_back(neighbours[k]);
+        }
+    }
+}
+
+// Lock striping for the in-place iteration. The grid is split in square tiles and
+// each tile is guarded by one of NUM_LOCK_STRIPES mutexes. An entity only locks the
+// tiles its neighbourhood touches, so workers on disjoint regions never contend.
+const uint32_t LOCK_TILE_SIZE = 32;
+const uint32_t NUM_LOCK_STRIPES = 4096;
+
+struct alignas(64) lock_stripe_t
+{
+    std::mutex mutex;
+};
+
+static lock_stripe_t lock_stripes[NUM_LOCK_STRIPES];
+
+uint32_t lock_stripe(uint32_t idx) {
+    uint32_t tiles_per_row = (entity_grid.num_cols + LOCK_TILE_SIZE - 1) / LOCK_TILE_SIZE;
+    uint32_t tile_row = idx / entity_grid.num_cols / LOCK_TILE_SIZE;
+    uint32_t tile_col = idx % entity_grid.num_cols / LOCK_TILE_SIZE;
+    return (tile_row * tiles_per_row + tile_col) % NUM_LOCK_STRIPES;
+}
+
+// Holds the stripes covering a cell and its neighbours, acquired in increasing
+// order so that overlapping neighbourhoods can't deadlock
+struct neighbourhood_lock_t
+{
+    uint32_t stripes[5];
+    uint32_t count = 0;
+
+    explicit neighbourhood_lock_t(uint32_t idx)
+    {
+        uint32_t neighbours[4];
+        uint32_t num_neighbours = neighbour_cells(idx, neighbours);
+
+        stripes[count++] = lock_stripe(idx);
+        for (uint32_t k = 0; k < num_neighbours; k++) {
+            stripes[count++] = lock_stripe(neighbours[k]);
+        }
+        std::sort(stripes, stripes + count);
+        count = std::unique(stripes, stripes + count) - stripes;
+
+        for (uint32_t k = 0; k < count; k++) {
+            lock_stripes[stripes[k]].mutex.lock();
+        }
+    }
+
+    ~neighbourhood_lock_t()
+    {
+        for (uint32_t k = count; k > 0; k--) {
+            lock_stripes[stripes[k - 1]].mutex.unlock();
+        }
+    }
+
+    neighbourhood_lock_t(const neighbourhood_lock_t &) = delete;
+    neighbourhood_lock_t &operator=(const neighbourhood_lock_t &) = delete;
+};
+
+template <typename access_t>
+void simul_plant(access_t &access, uint32_t idx) {
+    cell_list_t growth_positions_available;
+    cell_list_t no_prey;
+    scan_neighbours(access, idx, empty, growth_positions_available, no_prey);
+
+    if (!growth_positions_available.empty()) {
+        philox_block_t draw = random_draw(idx, draw_reproduce);
+        bool try_to_reproduct = random_action(draw, PLANT_REPRODUCTION_PROBABILITY);
+        if(try_to_reproduct == true) {
+            uint32_t sorted_position = growth_positions_available.random(draw);
+            access.place(sorted_position, plant, 0, 0);
+        }
+    }
+
+    entity_grid.age[idx] += 1;  // aumenta a idade da planta em 1
+
+    if (entity_grid.age[idx] == PLANT_MAXIMUM_AGE) {  // verifica se a planta atingiu a idade maxima e se sim a planta morre
+        entity_grid.clear(idx);
+    }
+
+    LOG_TRACE("terminou planta planta %u", idx);
+}
+
+// Parameters that distinguish herbivores from carnivores
+struct animal_rules_t
+{
+    entity_type_t species;
+    entity_type_t prey;
+    double eat_probability;
+    int32_t eat_energy;
+    double reproduction_probability;
+    double move_probability;
+    int32_t maximum_age;
+};
+
+const animal_rules_t HERBIVORE_RULES = {herbivore, plant, HERBIVORE_EAT_PROBABILITY, 30,
+                                        HERBIVORE_REPRODUCTION_PROBABILITY, HERBIVORE_MOVE_PROBABILITY, HERBIVORE_MAXIMUM_AGE};
+const animal_rules_t CARNIVORE_RULES = {carnivore, herbivore, CARNIVORE_EAT_PROBABILITY, 20,
+                                        CARNIVORE_REPRODUCTION_PROBABILITY, CARNIVORE_MOVE_PROBABILITY, CARNIVORE_MAXIMUM_AGE};
+
+const animal_rules_t &animal_rules(entity_type_t species) {
+    return species == herbivore ? HERBIVORE_RULES : CARNIVORE_RULES;
+}
+
+// Behaviour shared by herbivores and carnivores: eat an adjacent prey, reproduce
+// into an empty neighbour, then move
+template <typename access_t>
+void simul_animal(access_t &access, uint32_t idx, const animal_rules_t &rules) {
+    cell_list_t neighboring_empty_positions; // posicoes vazias adjacentes
+    cell_list_t neighboring_prey_positions; // posicoes com presas adjacentes
+    scan_neighbours(access, idx, rules.prey, neighboring_empty_positions, neighboring_prey_positions);
+
+    // tentativa de comer uma presa
+    if (!neighboring_prey_positions.empty()) {
+        philox_block_t draw = random_draw(idx, draw_eat);
+        bool try_to_eat = random_action(draw, rules.eat_probability);
+        if(try_to_eat == true) {
+            uint32_t eat_position = neighboring_prey_positions.random(draw);
+            if (access.eat(idx, eat_position, rules.eat_energy)) {
+                neighboring_empty_positions.push_back(eat_position);
+            }
+            else {
+                // The meal is settled after the iteration; the animal waits for it
+                // instead of reproducing or moving
+                neighboring_empty_positions.clear();
+            }
+        }
+    }
+
+    // tentativa de se reproduzir
+    if (!neighboring_empty_positions.empty()) {
+        if(entity_grid.energy[idx] > THRESHOLD_ENERGY_FOR_REPRODUCTION) {
+            philox_block_t draw = random_draw(idx, draw_reproduce);
+            bool try_to_reproduce = random_action(draw, rules.reproduction_probability);
+            if(try_to_reproduce == true) {
+                uint32_t child_position = neighboring_empty_positions.random(draw);
+                access.place(child_position, rules.species, 100, 0);
+
+                entity_grid.energy[idx] = entity_grid.energy[idx] - 10;
+                neighboring_empty_positions.erase(child_position);
+            }
+        }
+    }
+
+    // tentativa de se movimentar
+    if (!neighboring_empty_positions.empty()) {
+        philox_block_t draw = random_draw(idx, draw_move);
+        bool try_to_move = random_action(draw, rules.move_probability);
+        if(try_to_move == true) {
+            uint32_t move_position = neighboring_empty_positions.random(draw);
+            int32_t energy = entity_grid.energy[idx] - 5;
+            int32_t age = entity_grid.age[idx] + 1;
+
+            // morre ao chegar se atingiu a idade maxima ou ficou sem energia
+            if (age != rules.maximum_age && energy > 0) {
+                access.move(idx, move_position, rules.species, energy, age);
+            }
+            else {
+                entity_grid.clear(idx);
+            }
+            return;
+        }
+    }
+
+    entity_grid.age[idx] += 1;
+
+    if (entity_grid.age[idx] == rules.maximum_age || entity_grid.energy[idx] <= 0) { 
+        entity_grid.clear(idx);
+    }
+}
+
+template <typename access_t>
+void simul_herbivore(access_t &access, uint32_t idx) {
+    simul_animal(access, idx, HERBIVORE_RULES);
+    LOG_TRACE("terminou herbivoro %u", idx);
+}
+
+template <typename access_t>
+void simul_carnivore(access_t &access, uint32_t idx) {
+    simul_animal(access, idx, CARNIVORE_RULES);
+    LOG_TRACE("terminou carnivoro %u", idx);
+}
+
+// Simulates the entity that occupies the cell idx when the worker gets to it.
+// The cell may have changed since it was scheduled (eaten, moved or already
+// updated by a neighbour), so its content is checked again here.
+template <typename access_t>
+void simul_entity(access_t &access, uint32_t idx) {
+    if (entity_grid.already_atualized[idx]) {
+        return;
+    }
+
+    switch (entity_grid.type[idx]) {
+    case plant:
+        simul_plant(access, idx);
+        break;
+    case herbivore:
+        simul_herbivore(access, idx);
+        break;
+    case carnivore:
+        simul_carnivore(access, idx);
+        break;
+    default:
+        return;
+    }
+    access.touch(idx);
+}
+
+void simul_cell(uint32_t idx, std::vector<uint32_t> &dirty) {
+    neighbourhood_lock_t lock(idx);
+    grid_access_t access(dirty);
+    simul_entity(access, idx);
+}
+
+// Double-buffered iteration. Every entity first proposes its actions looking only
+// at entity_grid, which stays frozen until the end of the iteration. The next
+// state of each cell an entity affects is then resolved on its own from the
+// proposals of the cell and its neighbours, logged, and written once every cell
+// has been resolved. Each changed cell has exactly one writer, so all phases run
+// in parallel without locks and the outcome doesn't depend on the order in which
+// cells are processed. Contested cells go to the first claimant in scan order
+// (below, above, right, left).
+
+// Next state of a cell
+struct cell_write_t
+{
+    uint32_t idx;
+    entity_type_t type;
+    int16_t energy;
+    int16_t age;
+};
+
+// Cells resolved during a double-buffered iteration, one log per worker
+static std::vector<std::vector<cell_write_t>> cell_writes;
+
+void propose_plant(uint32_t idx, intent_t &intent) {
+    cell_list_t growth_positions_available;
+    cell_list_t no_prey;
+    scan_neighbours(grid_reader_t(), idx, empty, growth_positions_available, no_prey);
+
+    philox_block_t draw = random_draw(idx, draw_reproduce);
+    if (!growth_positions_available.empty() && random_action(draw, PLANT_REPRODUCTION_PROBABILITY)) {
+        intent.child_target = growth_positions_available.random(draw);
+    }
+}
+
+void propose_animal(uint32_t idx, const animal_rules_t &rules, intent_t &intent) {
+    cell_list_t neighboring_empty_positions;
+    cell_list_t neighboring_prey_positions;
+    scan_neighbours(grid_reader_t(), idx, rules.prey, neighboring_empty_positions, neighboring_prey_positions);
+
+    // Energy assuming the meal succeeds, the same the in-place update would see
+    int32_t energy = entity_grid.energy[idx];
+    philox_block_t eat_draw = random_draw(idx, draw_eat);
+    if (!neighboring_prey_positions.empty() && random_action(eat_draw, rules.eat_probability)) {
+        intent.eat_target = neighboring_prey_positions.random(eat_draw);
+        energy = std::min<int32_t>(energy + rules.eat_energy, MAXIMUM_ENERGY);
+        neighboring_empty_positions.push_back(intent.eat_target);
+    }
+
+    philox_block_t reproduce_draw = random_draw(idx, draw_reproduce);
+    if (!neighboring_empty_positions.empty() && energy > THRESHOLD_ENERGY_FOR_REPRODUCTION &&
+        random_action(reproduce_draw, rules.reproduction_probability)) {
+        intent.child_target = neighboring_empty_positions.random(reproduce_draw);
+        neighboring_empty_positions.erase(intent.child_target);
+    }
+
+    philox_block_t move_draw = random_draw(idx, draw_move);
+    if (!neighboring_empty_positions.empty() && random_action(move_draw, rules.move_probability)) {
+        intent.move_target = neighboring_empty_positions.random(move_draw);
+    }
+}
+
+// Returns the predator that eats the entity at idx, or NO_CELL. A predator that is
+// eaten itself doesn't get to eat; carnivores are nobody's prey.
+uint32_t resolve_eater(uint32_t idx) {
+    uint32_t neighbours[4];
+    uint32_t count = neighbour_cells(idx, neighbours);
+
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t predator = neighbours[k];
+        if (intents[predator].eat_target == idx &&
+            (entity_grid.type[predator] == carnivore || resolve_eater(predator) == NO_CELL)) {
+            return predator;
+        }
+    }
+    return NO_CELL;
+}
+
+// Returns the neighbour whose offspring or move takes the cell idx, or NO_CELL.
+// An occupied cell can only be taken by the predator that ate its occupant.
+uint32_t resolve_claimant(uint32_t idx) {
+    uint32_t eater = NO_CELL;
+    if (entity_grid.type[idx] != empty) {
+        eater = resolve_eater(idx);
+        if (eater == NO_CELL) {
+            return NO_CELL;
+        }
+    }
+
+    uint32_t neighbours[4];
+    uint32_t count = neighbour_cells(idx, neighbours);
+
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t claimant = neighbours[k];
+        if (intents[claimant].child_target != idx && intents[claimant].move_target != idx) {
+            continue;
+        }
+        if (eater != NO_CELL ? claimant == eater : resolve_eater(claimant) == NO_CELL) {
+            return claimant;
+        }
+    }
+    return NO_CELL;
+}
+
+// Energy of the animal at idx once its meal and offspring have been resolved
+int32_t resolved_energy(uint32_t idx) {
+    const animal_rules_t &rules = animal_rules(entity_grid.type[idx]);
+    const intent_t &intent = intents[idx];
+    int32_t energy = entity_grid.energy[idx];
+
+    if (intent.eat_target != NO_CELL && resolve_eater(intent.eat_target) == idx) {
+        energy = std::min<int32_t>(energy + rules.eat_energy, MAXIMUM_ENERGY);
+    }
+    if (intent.child_target != NO_CELL && resolve_claimant(intent.child_target) == idx) {
+        energy -= 10;
+    }
+    return energy;
+}
+
+// Returns the entity from source, one iteration older, as the next state of
+// target, or an empty cell if it dies of age or starvation
+cell_write_t write_aged(uint32_t target, uint32_t source, int32_t energy) {
+    entity_type_t type = entity_grid.type[source];
+    int32_t age = entity_grid.age[source] + 1;
+
+    if (type == plant ? age == PLANT_MAXIMUM_AGE : age == animal_rules(type).maximum_age || energy <= 0) {
+        return {target, empty, 0, 0};
+    }
+    return {target, type, (int16_t)energy, (int16_t)age};
+}
+
+cell_write_t resolve_cell(uint32_t idx) {
+    entity_type_t type = entity_grid.type[idx];
+
+    // The occupant survived predation, so it either moved away or stays here
+    if (type != empty && resolve_eater(idx) == NO_CELL) {
+        const intent_t &intent = intents[idx];
+        if (intent.move_target != NO_CELL && resolve_claimant(intent.move_target) == idx) {
+            return {idx, empty, 0, 0};
+        }
+        return write_aged(idx, idx, type == plant ? 0 : resolved_energy(idx));
+    }
+
+    uint32_t claimant = resolve_claimant(idx);
+    if (claimant == NO_CELL) {
+        return {idx, empty, 0, 0};
+    }
+    if (intents[claimant].child_target == idx) {
+        entity_type_t species = entity_grid.type[claimant];
+        return {idx, species, (int16_t)(species == plant ? 0 : 100), 0};
+    }
+    return write_aged(idx, claimant, resolved_energy(claimant) - 5);
+}
+
+// Resolves the cells the entity at idx is responsible for: its own cell unless
+// it was eaten (the predator's then), the prey it won and the empty cells its
+// offspring or move won
+void resolve_entity(uint32_t idx, std::vector<cell_write_t> &writes) {
+    if (resolve_eater(idx) != NO_CELL) {
+        return;
+    }
+    writes.push_back(resolve_cell(idx));
+
+    const intent_t &intent = intents[idx];
+    if (intent.eat_target != NO_CELL && resolve_eater(intent.eat_target) == idx) {
+        writes.push_back(resolve_cell(intent.eat_target));
+    }
+    for (uint32_t target : {intent.child_target, intent.move_target}) {
+        if (target != NO_CELL && entity_grid.type[target] == empty && resolve_claimant(target) == idx) {
+            writes.push_back(resolve_cell(target));
+        }
+    }
+}
+
+void next_iteration_double_buffered(worker_pool &workers) {
+    std::vector<uint32_t> cells = sorted_live_cells();
+    cell_writes.resize(workers.size());
+
+    workers.parallel_for(cells.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            uint32_t idx = cells[k];
+            switch (entity_grid.type[idx]) {
+            case plant:
+                propose_plant(idx, intents[idx]);
+                break;
+            case herbivore:
+                propose_animal(idx, HERBIVORE_RULES, intents[idx]);
+                break;
+            case carnivore:
+                propose_animal(idx, CARNIVORE_RULES, intents[idx]);
+                break;
+            default:
+                break;
+            }
+        }
+    });
+
+    workers.parallel_for(cells.size(), [&](size_t worker, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            resolve_entity(cells[k], cell_writes[worker]);
+        }
+    });
+
+    workers.parallel_for(cells.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            intents[cells[k]] = intent_t();
+        }
+    });
+
+    workers.parallel_for(cell_writes.size(), [](size_t worker, size_t begin, size_t end) {
+        for (size_t w = begin; w < end; w++) {
+            for (const cell_write_t &write : cell_writes[w]) {
+                entity_grid.set(write.idx, write.type, write.energy, write.age);
+                dirty_cells[worker].push_back(write.idx);
+            }
+            cell_writes[w].clear();
+        }
+    }, 1);
+}
+
+// In-place iteration: entities write directly into entity_grid, skipping the
+// cells that were already updated, and lock only their own neighbourhood
+void next_iteration_in_place(worker_pool &workers) {
+    std::vector<uint32_t> occupied_cells = sorted_live_cells();
+
+    workers.parallel_for(occupied_cells.size(), [&](size_t worker, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            simul_cell(occupied_cells[k], dirty_cells[worker]);
+        }
+    });
+}
+
+// Checkerboard iteration. The grid is split in square tiles coloured like a 2x2
+// checkerboard. Tiles of the same colour are at least one tile apart, so the
+// neighbourhoods of their entities never overlap and they are simulated in
+// parallel without locks. The pool's barrier separates the four colours.
+const uint32_t CHECKERBOARD_TILE_SIZE = 16;
+
+void next_iteration_checkerboard(worker_pool &workers) {
+    uint32_t tile_rows = (entity_grid.num_rows + CHECKERBOARD_TILE_SIZE - 1) / CHECKERBOARD_TILE_SIZE;
+    uint32_t tile_cols = (entity_grid.num_cols + CHECKERBOARD_TILE_SIZE - 1) / CHECKERBOARD_TILE_SIZE;
+    uint32_t num_tiles = tile_rows * tile_cols;
+
+    // Sort the live cells by colour, then tile, then row-major position
+    std::vector<std::pair<uint32_t, uint32_t>> cells;
+    for (uint32_t idx : sorted_live_cells()) {
+        uint32_t tile_row = idx / entity_grid.num_cols / CHECKERBOARD_TILE_SIZE;
+        uint32_t tile_col = idx % entity_grid.num_cols / CHECKERBOARD_TILE_SIZE;
+        uint32_t colour = (tile_row % 2) * 2 + tile_col % 2;
+        cells.push_back({colour * num_tiles + tile_row * tile_cols + tile_col, idx});
+    }
+    std::stable_sort(cells.begin(), cells.end(),
+                     [](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b) { return a.first < b.first; });
+
+    std::vector<size_t> tile_starts;
+    size_t colour_begin = 0;
+    for (uint32_t colour = 0; colour < 4; colour++) {
+        size_t colour_end = colour_begin;
+        tile_starts.clear();
+        while (colour_end < cells.size() && cells[colour_end].first / num_tiles == colour) {
+            if (colour_end == colour_begin || cells[colour_end].first != cells[colour_end - 1].first) {
+                tile_starts.push_back(colour_end);
+            }
+            colour_end++;
+        }
+        tile_starts.push_back(colour_end);
+
+        workers.parallel_for(tile_starts.size() - 1, [&](size_t worker, size_t begin, size_t end) {
+            grid_access_t access(dirty_cells[worker]);
+            for (size_t k = tile_starts[begin]; k < tile_starts[end]; k++) {
+                simul_entity(access, cells[k].second);
+            }
+        });
+        colour_begin = colour_end;
+    }
+}
+
+// Row-strip iteration. The grid is split in horizontal strips, one per worker.
+// Before the iteration each strip copies the types of the rows just outside it
+// (its halo); during the iteration it reads its neighbours' cells only from the
+// halo and queues the writes that cross its border (moves, offspring and meals)
+// as migrations. After the barrier the migrations are applied in strip order.
+// An entity moving across the border stays in its cell until then, and stays
+// there for good if the target got occupied meanwhile; offspring that don't fit
+// are dropped. An animal eating across the border gets no energy and does
+// nothing else until its meal is applied, which only happens if both the animal
+// and the prey are still there.
+
+// Write into a cell owned by another strip
+struct migration_t
+{
+    uint32_t target;
+    entity_type_t type;     // entity arriving at target, or empty if its occupant is eaten
+    entity_type_t expected; // type of the eaten occupant as seen in the halo
+    int16_t energy;         // of the arriving entity, or gained by the eater
+    int16_t age;
+    uint32_t source;        // cell of the moving entity or of the eater, NO_CELL for offspring
+    int16_t source_energy;  // state the entity at source must still be in, so that
+    int16_t source_age;     // another one of its species that took the cell isn't moved or fed
+};
+
+struct strip_t
+{
+    uint32_t begin; // first cell of the strip
+    uint32_t end;   // one past the last cell of the strip
+    size_t first_live; // range of the iteration's live cells inside the strip
+    size_t last_live;
+    std::vector<entity_type_t> halo_above;
+    std::vector<entity_type_t> halo_below;
+    std::vector<migration_t> migrations;
+};
+
+static std::vector<strip_t> strips;
+
+struct strip_access_t
+{
+    strip_t &strip;
+    grid_access_t grid;
+
+    bool owns(uint32_t idx) const { return idx >= strip.begin && idx < strip.end; }
+
+    entity_type_t type(uint32_t idx) const
+    {
+        if (idx < strip.begin) {
+            return strip.halo_above[idx + strip.halo_above.size() - strip.begin];
+        }
+        if (idx >= strip.end) {
+            return strip.halo_below[idx - strip.end];
+        }
+        return entity_grid.type[idx];
+    }
+
+    void place(uint32_t idx, entity_type_t type, int32_t energy, int32_t age)
+    {
+        if (owns(idx)) {
+            grid.place(idx, type, energy, age);
+        }
+        else {
+            strip.migrations.push_back({idx, type, empty, (int16_t)energy, (int16_t)age, NO_CELL, 0, 0});
+        }
+    }
+
+    void move(uint32_t from, uint32_t to, entity_type_t type, int32_t energy, int32_t age)
+    {
+        if (owns(to)) {
+            grid.move(from, to, type, energy, age);
+        }
+        else {
+            entity_grid.set(from, type, energy, age);
+            strip.migrations.push_back({to, type, empty, (int16_t)energy, (int16_t)age, from, (int16_t)energy, (int16_t)age});
+        }
+    }
+
+    bool eat(uint32_t eater, uint32_t prey, int32_t energy)
+    {
+        if (owns(prey)) {
+            return grid.eat(eater, prey, energy);
+        }
+        // The waiting eater still ages by one before the end of its turn
+        strip.migrations.push_back({prey, empty, this->type(prey), (int16_t)energy, 0, eater,
+                                    entity_grid.energy[eater], (int16_t)(entity_grid.age[eater] + 1)});
+        return false;
+    }
+
+    void touch(uint32_t idx) { grid.touch(idx); }
+};
+
+bool source_unchanged(const migration_t &migration, entity_type_t type) {
+    return entity_grid.type[migration.source] == type && entity_grid.energy[migration.source] == migration.source_energy &&
+           entity_grid.age[migration.source] == migration.source_age;
+}
+
+void apply_migration(grid_access_t &access, const migration_t &migration) {
+    if (migration.type == empty) {
+        entity_type_t eater = migration.expected == HERBIVORE_RULES.prey ? herbivore : carnivore;
+        if (entity_grid.type[migration.target] == migration.expected && source_unchanged(migration, eater)) {
+            access.eat(migration.source, migration.target, migration.energy);
+        }
+    }
+    else if (migration.source == NO_CELL) {
+        if (entity_grid.type[migration.target] == empty) {
+            access.place(migration.target, migration.type, migration.energy, migration.age);
+        }
+    }
+    else if (entity_grid.type[migration.target] == empty && source_unchanged(migration, migration.type)) {
+        // Otherwise the mover stays where it is, unless it was eaten meanwhile
+        access.move(migration.source, migration.target, migration.type, migration.energy, migration.age);
+    }
+}
+
+void next_iteration_strips(worker_pool &workers) {
+    std::vector<uint32_t> cells = sorted_live_cells();
+    uint32_t num_strips = std::min<uint32_t>(workers.size(), entity_grid.num_rows);
+    strips.resize(num_strips);
+    for (uint32_t k = 0; k < num_strips; k++) {
+        strips[k].begin = entity_grid.index((uint64_t)entity_grid.num_rows * k / num_strips, 0);
+        strips[k].end = entity_grid.index((uint64_t)entity_grid.num_rows * (k + 1) / num_strips, 0);
+        strips[k].first_live = std::lower_bound(cells.begin(), cells.end(), strips[k].begin) - cells.begin();
+        strips[k].last_live = std::lower_bound(cells.begin(), cells.end(), strips[k].end) - cells.begin();
+    }
+
+    // Halo exchange
+    workers.parallel_for(num_strips, [](size_t, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            strip_t &strip = strips[k];
+            uint32_t above = strip.begin > 0 ? entity_grid.num_cols : 0;
+            uint32_t below = strip.end < entity_grid.size() ? entity_grid.num_cols : 0;
+            strip.halo_above.assign(entity_grid.type.begin() + strip.begin - above, entity_grid.type.begin() + strip.begin);
+            strip.halo_below.assign(entity_grid.type.begin() + strip.end, entity_grid.type.begin() + strip.end + below);
+            strip.migrations.clear();
+        }
+    });
+
+    workers.parallel_for(num_strips, [&](size_t worker, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            strip_access_t access{strips[k], grid_access_t(dirty_cells[worker])};
+            for (size_t live = strips[k].first_live; live < strips[k].last_live; live++) {
+                simul_entity(access, cells[live]);
+            }
+        }
+    });
+
+    grid_access_t access(dirty_cells[0]);
+    for (const strip_t &strip : strips) {
+        for (const migration_t &migration : strip.migrations) {
+            apply_migration(access, migration);
+        }
+    }
+}
+
+tick_metrics_t tick_metrics;
+
+const char *const TICK_PHASE_NAMES[NUM_TICK_PHASES] = {"reset", "dispatch", "entity_update", "join", "publish"};
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
+
+void publish_live_entities() {
+    for (entity_type_t species : {plant, herbivore, carnivore}) {
+        tick_metrics.live_entities[species].store(population(species), std::memory_order_relaxed);
+    }
+}
+
+void next_iteration(worker_pool &workers) {
+    auto start = std::chrono::steady_clock::now();
+    pool_timing_t pool_before = workers.timing();
+    dirty_cells.resize(workers.size());
+
+    switch (tick_mode) {
+    case tick_in_place:
+        next_iteration_in_place(workers);
+        break;
+    case tick_checkerboard:
+        next_iteration_checkerboard(workers);
+        break;
+    case tick_strips:
+        next_iteration_strips(workers);
+        break;
+    case tick_double_buffered:
+        next_iteration_double_buffered(workers);
+        break;
+    }
+
+    pool_timing_t pool_after = workers.timing();
+    auto simulated = std::chrono::steady_clock::now();
+    update_live_cells(workers, current_tick + 1);
+    current_tick++;
+    auto end = std::chrono::steady_clock::now();
+
+    // Whatever the entity passes didn't spend running or joining went into
+    // building their schedule and handing it to the workers
+    uint64_t run_ns = pool_after.run_ns - pool_before.run_ns;
+    uint64_t join_ns = pool_after.join_ns - pool_before.join_ns;
+    uint64_t simulate_ns = elapsed_ns(start, simulated);
+    tick_metrics.phases[phase_reset].record(elapsed_ns(simulated, end));
+    tick_metrics.phases[phase_dispatch].record(simulate_ns > run_ns + join_ns ? simulate_ns - run_ns - join_ns : 0);
+    tick_metrics.phases[phase_entity_update].record(run_ns);
+    tick_metrics.phases[phase_join].record(join_ns);
+    tick_metrics.ticks.fetch_add(1, std::memory_order_relaxed);
+    publish_live_entities();
+}
+
+void start_simulation(const simulation_config_t &config) {
+    tick_mode = config.mode;
+    simulation_seed = config.seed;
+    current_tick = 0;
+    current_run++;
+    entity_grid.reset(config.rows, config.cols);
+
+    xoshiro256_t random(config.seed);
+    const std::pair<entity_type_t, uint32_t> populations[] = {{plant, config.plants}, {herbivore, config.herbivores}, {carnivore, config.carnivores}};
+    uint32_t free_cells = entity_grid.size();
+    for (const auto &population : populations) {
+        // Placement stops once the grid is full, instead of searching forever
+        // for an empty cell
+        uint32_t count = std::min(population.second, free_cells);
+        free_cells -= count;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t rand_cell = random.below(entity_grid.size());
+            while (entity_grid.type[rand_cell] != empty) {
+                rand_cell = random.below(entity_grid.size());
+            }
+
+            entity_grid.set(rand_cell, population.first, population.first == plant ? 0 : 100, 0);
+        }
+    }
+    rebuild_live_cells();
+    publish_live_entities();
+    intents.assign(tick_mode == tick_double_buffered ? entity_grid.size() : 0, intent_t());
+}
+
+uint32_t simulation_tick() {
+    return current_tick;
+}
+
+uint32_t simulation_run() {
+    return current_run;
+}
+
+bool grid_snapshot_t::cells_changed_since(uint32_t base_run, uint32_t base_tick, std::vector<uint32_t> &cells) const {
+    cells.clear();
+    if (base_run != run || base_tick > tick || tick - base_tick > DELTA_HISTORY_TICKS) {
+        return false;
+    }
+    for (uint32_t changed_tick = base_tick + 1; changed_tick <= tick; changed_tick++) {
+        const std::shared_ptr<const std::vector<uint32_t>> &history = changes[changed_tick % DELTA_HISTORY_TICKS];
+        if (history) {
+            cells.insert(cells.end(), history->begin(), history->end());
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    return true;
+}
+
+// Slots of the snapshots and the one last published. A slot other than the
+// latest with no references is free: no reader holds it, and none can get it
+// any more (see latest_snapshot).
+static snapshot_slot_t snapshot_slots[NUM_SNAPSHOT_SLOTS];
+static std::atomic<snapshot_slot_t *> latest_slot{&snapshot_slots[0]};
+static_assert(std::atomic<snapshot_slot_t *>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "snapshot readers must not take locks");
+
+uint32_t snapshot_slot_limit(uint64_t cells) {
+    uint64_t slot_bytes = std::max<uint64_t>(1, cells * SNAPSHOT_BYTES_PER_CELL);
+    return std::max<uint64_t>(MINIMUM_SNAPSHOT_SLOTS, std::min<uint64_t>(NUM_SNAPSHOT_SLOTS, MAXIMUM_SNAPSHOT_BYTES / slot_bytes));
+}
+
+// Whether a slot's grid is too old to be caught up cell by cell, so that it
+// would be copied whole anyway the next time the slot is used
+bool stale_snapshot(const grid_snapshot_t &snapshot) {
+    return snapshot.run != current_run || snapshot.tick > current_tick || current_tick - snapshot.tick > DELTA_HISTORY_TICKS;
+}
+
+// Gives back the memory of the free slots that hold a stale grid. Slots are
+// filled only when readers hold the others, so this leaves as many grids as
+// readers recently needed. The changes go back to the spare lists.
+void release_stale_snapshots() {
+    snapshot_slot_t *latest = latest_slot.load();
+    for (snapshot_slot_t &slot : snapshot_slots) {
+        if (&slot == latest || slot.references.load() != 0 || slot.snapshot.grid.type.capacity() == 0 ||
+            !stale_snapshot(slot.snapshot)) {
+            continue;
+        }
+        slot.snapshot.grid = entity_grid_t();
+        for (auto &changes : slot.snapshot.changes) {
+            changes.reset();
+        }
+    }
+}
+
+// The free slot to refill: the newest one of the current run, which needs the
+// fewest cells copied to catch up. Only the first slot_limit slots are used.
+snapshot_slot_t *free_snapshot_slot(uint32_t slot_limit) {
+    snapshot_slot_t *latest = latest_slot.load();
+    while (true) {
+        snapshot_slot_t *chosen = nullptr;
+        for (uint32_t k = 0; k < slot_limit; k++) {
+            snapshot_slot_t &slot = snapshot_slots[k];
+            if (&slot == latest || slot.references.load() != 0) {
+                continue;
+            }
+            if (chosen == nullptr || std::make_pair(slot.snapshot.run == current_run, slot.snapshot.tick) >
+                                         std::make_pair(chosen->snapshot.run == current_run, chosen->snapshot.tick)) {
+                chosen = &slot;
+            }
+        }
+        if (chosen != nullptr) {
+            return chosen;
+        }
+        std::this_thread::yield();
+    }
+}
+
+snapshot_ref_t publish_snapshot() {
+    auto start = std::chrono::steady_clock::now();
+    snapshot_slot_t *slot = free_snapshot_slot(snapshot_slot_limit(entity_grid.size()));
+    grid_snapshot_t &snapshot = slot->snapshot;
+
+    // When the slot holds a recent grid of this run, only the cells written since
+    // its tick differ. Copying them one by one costs about as much per cell as
+    // copying 32 cells of the whole grid in a block, so a busy grid is still
+    // copied whole.
+    bool catch_up = !stale_snapshot(snapshot);
+    uint64_t catch_up_cells = 0;
+    for (uint32_t tick = snapshot.tick + 1; catch_up && tick <= current_tick; tick++) {
+        catch_up_cells += changed_cells[tick % DELTA_HISTORY_TICKS]->size();
+    }
+    if (catch_up && catch_up_cells * 32 < entity_grid.size()) {
+        for (uint32_t tick = snapshot.tick + 1; tick <= current_tick; tick++) {
+            for (uint32_t idx : *changed_cells[tick % DELTA_HISTORY_TICKS]) {
+                snapshot.grid.set(idx, entity_grid.type[idx], entity_grid.energy[idx], entity_grid.age[idx]);
+            }
+        }
+    }
+    else {
+        snapshot.grid.num_rows = entity_grid.num_rows;
+        snapshot.grid.num_cols = entity_grid.num_cols;
+        snapshot.grid.type = entity_grid.type;
+        snapshot.grid.energy = entity_grid.energy;
+        snapshot.grid.age = entity_grid.age;
+    }
+    snapshot.run = current_run;
+    snapshot.tick = current_tick;
+    for (entity_type_t species : {plant, herbivore, carnivore}) {
+        snapshot.populations[species] = population(species);
+    }
+    snapshot.stats = population_totals;
+    for (uint32_t k = 0; k < DELTA_HISTORY_TICKS; k++) {
+        snapshot.changes[k] = changed_cells[k];
+    }
+
+    // The publisher's own reference. A reader may have counted itself in the
+    // slot in passing, so it is added rather than stored.
+    slot->references.fetch_add(1);
+    latest_slot.store(slot);
+    release_stale_snapshots();
+    tick_metrics.phases[phase_publish].record(elapsed_ns(start, std::chrono::steady_clock::now()));
+    return snapshot_ref_t(slot);
+}
+
+// The reference is taken before checking that the slot is still the latest,
+// so once the check passes the publisher sees it and leaves the slot alone.
+// All operations are sequentially consistent, which this ordering relies on.
+snapshot_ref_t latest_snapshot() {
+    while (true) {
+        snapshot_slot_t *slot = latest_slot.load();
+        slot->references.fetch_add(1);
+        if (latest_slot.load() == slot) {
+            return snapshot_ref_t(slot);
+        }
+        slot->references.fetch_sub(1);
+    }
+}
+
+uint32_t population(entity_type_t species) {
+    return live_cells[species].size();
+}
+
+const population_stats_t &population_stats() {
+    return population_totals;
+}
+
+uint64_t scan_live_neighbourhoods() {
+    uint64_t found = 0;
+    for (entity_type_t species : {plant, herbivore, carnivore}) {
+        entity_type_t prey = species == plant ? empty : animal_rules(species).prey;
+        for (uint32_t idx : live_cells[species]) {
+            cell_list_t empty_cells;
+            cell_list_t prey_cells;
+            scan_neighbours(grid_reader_t(), idx, prey, empty_cells, prey_cells);
+            found += empty_cells.count + prey_cells.count;
+        }
+    }
+    return found;
+}
+
+uint64_t draw_random_actions(uint64_t count) {
+    if (population(plant) + population(herbivore) + population(carnivore) == 0) {
+        return 0;
+    }
+
+    cell_list_t targets;
+    for (uint32_t k = 0; k < 4; k++) {
+        targets.push_back(k);
+    }
+    uint64_t checksum = 0;
+    uint64_t drawn = 0;
+    while (drawn < count) {
+        for (entity_type_t species : {plant, herbivore, carnivore}) {
+            for (size_t k = 0; k < live_cells[species].size() && drawn < count; k++, drawn++) {
+                philox_block_t draw = random_draw(live_cells[species][k], (random_draw_t)(drawn % 3));
+                if (random_action(draw, HERBIVORE_MOVE_PROBABILITY)) {
+                    checksum += 1 + targets.random(draw);
+                }
+            }
+        }
+    }
+    return checksum;
+}
+
+const char *stop_reason_name(stop_reason_t reason) {
+    switch (reason) {
+    case stop_extinction:
+        return "extinction";
+    case stop_steady_state:
+        return "steady_state";
+    case stop_max_ticks:
+        return "max_ticks";
+    case stop_wall_clock:
+        return "wall_clock";
+    default:
+        return "none";
+    }
+}
+
+run_monitor_t::run_monitor_t(const stop_conditions_t &conditions) : conditions(conditions), start(std::chrono::steady_clock::now()) {
+    for (entity_type_t type : {empty, plant, herbivore, carnivore}) {
+        uint32_t count = type == empty ? 0 : population(type);
+        species[type] = {count, count, 0};
+        alive_at_start[type] = count > 0;
+    }
+    steady_reference = population(plant) + population(herbivore) + population(carnivore);
+}
+
+stop_reason_t run_monitor_t::observe() {
+    ticks++;
+    uint64_t total = 0;
+    for (entity_type_t type : {plant, herbivore, carnivore}) {
+        uint32_t count = population(type);
+        species[type].minimum = std::min(species[type].minimum, count);
+        species[type].maximum = std::max(species[type].maximum, count);
+        species[type].sum += count;
+        total += count;
+
+        if (conditions.extinction && alive_at_start[type] && count == 0 && extinct_species == empty) {
+            extinct_species = type;
+        }
+    }
+    if (extinct_species != empty) {
+        return stop_extinction;
+    }
+
+    // The window restarts from the current total whenever it drifts out of the band
+    if (conditions.steady_ticks > 0) {
+        double band = conditions.steady_epsilon * steady_reference;
+        if (std::abs((double)total - (double)steady_reference) <= band) {
+            if (++steady_count >= conditions.steady_ticks) {
+                return stop_steady_state;
+            }
+        }
+        else {
+            steady_reference = total;
+            steady_count = 0;
+        }
+    }
+
+    if (conditions.max_ticks > 0 && ticks >= conditions.max_ticks) {
+        return stop_max_ticks;
+    }
+    if (conditions.max_seconds > 0 && seconds() >= conditions.max_seconds) {
+        return stop_wall_clock;
+    }
+    return stop_none;
+}
+
+double run_monitor_t::seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+stop_reason_t run_until(worker_pool &workers, run_monitor_t &monitor) {
+    stop_reason_t reason = stop_none;
+    while (reason == stop_none) {
+        next_iteration(workers);
+        reason = monitor.observe();
+    }
+    return reason;
+}
@@ -0,0 +1,319 @@
+#ifndef ECOSIM_SIMULATION_H
+#define ECOSIM_SIMULATION_H
+
+#include "metrics.h"
+#include "worker_pool.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Default grid dimensions, used when /start-simulation or ecosim-cli don't specify them
+const uint32_t DEFAULT_NUM_ROWS = 15;
+const uint32_t DEFAULT_NUM_COLS = 15;
+const uint64_t MAXIMUM_NUM_CELLS = 100000000;
+
+// Type definitions
+enum entity_type_t : uint8_t
+{
+    empty,
+    plant,
+    herbivore,
+    carnivore
+};
+
+// Grid that contains the entities. Cells are stored row-major in one contiguous
+// block per field, so scanning for a type or a neighbour only touches `type`.
+struct entity_grid_t
+{
+    uint32_t num_rows = 0;
+    uint32_t num_cols = 0;
+    std::vector<entity_type_t> type;
+    std::vector<int16_t> energy;
+    std::vector<int16_t> age;
+    std::vector<uint8_t> already_atualized;
+
+    uint32_t size() const { return num_rows * num_cols; }
+    uint32_t index(uint32_t i, uint32_t j) const { return i * num_cols + j; }
+
+    void reset(uint32_t rows, uint32_t cols)
+    {
+        num_rows = rows;
+        num_cols = cols;
+        type.assign(size(), empty);
+        energy.assign(size(), 0);
+        age.assign(size(), 0);
+        already_atualized.assign(size(), false);
+    }
+
+    void set(uint32_t idx, entity_type_t new_type, int32_t new_energy, int32_t new_age)
+    {
+        type[idx] = new_type;
+        energy[idx] = new_energy;
+        age[idx] = new_age;
+    }
+
+    void clear(uint32_t idx) { set(idx, empty, 0, 0); }
+};
+
+// How an iteration updates the grid
+enum tick_mode_t
+{
+    tick_in_place,        // entities update entity_grid directly, skipping cells already updated
+    tick_checkerboard,    // in place, but tiles that can't interact are simulated together without locks
+    tick_strips,          // in place, each worker owns a strip of rows and defers writes across its border
+    tick_double_buffered  // entities read a frozen snapshot and propose actions resolved into the next grid
+};
+
+// Names accepted by the "mode" field of /start-simulation
+const std::pair<const char *, tick_mode_t> TICK_MODE_NAMES[] = {
+    {"in_place", tick_in_place},
+    {"checkerboard", tick_checkerboard},
+    {"strips", tick_strips},
+    {"double_buffered", tick_double_buffered},
+};
+
+bool parse_tick_mode(const std::string &name, tick_mode_t &mode);
+
+// Whether a seeded run in the mode gives the same result for any number of workers
+bool tick_mode_is_deterministic(tick_mode_t mode);
+
+// Mode used when a seed is given without a mode, so that seeded runs are
+// reproducible by default
+const tick_mode_t SEEDED_TICK_MODE = tick_checkerboard;
+
+// Initial state of a simulation. The populations must fit in the grid.
+struct simulation_config_t
+{
+    uint32_t rows = DEFAULT_NUM_ROWS;
+    uint32_t cols = DEFAULT_NUM_COLS;
+    tick_mode_t mode = tick_in_place; // SEEDED_TICK_MODE for runs given a seed
+    uint64_t seed = 0;
+    uint32_t plants = 0;
+    uint32_t herbivores = 0;
+    uint32_t carnivores = 0;
+};
+
+// Current state of the simulation
+extern entity_grid_t entity_grid;
+
+// (Re)starts the simulation, scattering the initial populations at random. If
+// they don't fit, each species in turn gets the cells still free.
+void start_simulation(const simulation_config_t &config);
+
+// Advances the simulation by one iteration
+void next_iteration(worker_pool &workers);
+
+// Parts of an iteration timed by tick_metrics: clearing the flags and counting
+// the written cells, scheduling the entity passes and waking the workers, the
+// entity passes until the first worker runs dry, the wait for the rest, and
+// copying the result into a snapshot for the readers (see publish_snapshot)
+enum tick_phase_t
+{
+    phase_reset,
+    phase_dispatch,
+    phase_entity_update,
+    phase_join,
+    phase_publish,
+    NUM_TICK_PHASES
+};
+
+extern const char *const TICK_PHASE_NAMES[NUM_TICK_PHASES];
+
+// Instrumentation of the iterations, recorded without locks so it can be read
+// while a tick is running
+struct tick_metrics_t
+{
+    latency_histogram_t phases[NUM_TICK_PHASES];
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint32_t> live_entities[4] = {}; // indexed by entity_type_t
+};
+
+extern tick_metrics_t tick_metrics;
+
+// Number of iterations computed since the simulation started
+uint32_t simulation_tick();
+
+// Identifier of the current simulation, incremented by every start_simulation, so
+// that a tick number can't be mistaken for the same tick of an earlier run
+uint32_t simulation_run();
+
+// Number of live entities of a species
+uint32_t population(entity_type_t species);
+
+// Ages are counted in buckets of AGE_BUCKET_WIDTH iterations, the last one
+// collecting everything older
+const uint32_t AGE_BUCKET_WIDTH = 10;
+const uint32_t NUM_AGE_BUCKETS = 9;
+
+// Totals over the live entities of each species (indexed by entity_type_t),
+// kept up to date as part of every iteration
+struct population_stats_t
+{
+    int64_t energy[4] = {};
+    int64_t age_histogram[4][NUM_AGE_BUCKETS] = {};
+};
+
+const population_stats_t &population_stats();
+
+// Iterations whose written cells are kept in a snapshot for cells_changed_since
+const uint32_t DELTA_HISTORY_TICKS = 64;
+
+// Immutable copy of the simulation after an iteration. Readers hold it through a
+// snapshot_ref_t for as long as they need it, while the engine goes on with the
+// next iterations.
+struct grid_snapshot_t
+{
+    uint32_t run = 0;
+    uint32_t tick = 0;
+    entity_grid_t grid; // already_atualized is left empty
+    uint32_t populations[4] = {}; // indexed by entity_type_t
+    population_stats_t stats;
+    // Cells written during each of the last iterations, indexed by tick modulo
+    // DELTA_HISTORY_TICKS
+    std::shared_ptr<const std::vector<uint32_t>> changes[DELTA_HISTORY_TICKS];
+
+    // Fills cells with the cells written after base_tick of the given run, in
+    // ascending order and without repeats. Returns false when the run has been
+    // replaced or base_tick is more than DELTA_HISTORY_TICKS behind, in which
+    // case only a full grid brings the caller up to date.
+    bool cells_changed_since(uint32_t base_run, uint32_t base_tick, std::vector<uint32_t> &cells) const;
+};
+
+// Snapshots live in a fixed set of slots that are refilled once no reader
+// holds them, so the common case allocates nothing. A slot gets a grid only
+// when readers hold the ones already filled, and gives it back once it is too
+// old to be caught up. Large grids use fewer slots, so that all of them fit in
+// MAXIMUM_SNAPSHOT_BYTES, but never fewer than MINIMUM_SNAPSHOT_SLOTS: the
+// latest, the one being refilled and one held by a reader.
+const uint32_t NUM_SNAPSHOT_SLOTS = 16;
+const uint32_t MINIMUM_SNAPSHOT_SLOTS = 3;
+const uint64_t MAXIMUM_SNAPSHOT_BYTES = 1ull << 30;
+const uint64_t SNAPSHOT_BYTES_PER_CELL = sizeof(entity_type_t) + 2 * sizeof(int16_t);
+
+// Number of slots used for a grid of that many cells
+uint32_t snapshot_slot_limit(uint64_t cells);
+
+struct snapshot_slot_t
+{
+    grid_snapshot_t snapshot;
+    std::atomic<uint32_t> references{0};
+};
+
+// Counted reference to a published snapshot. The slot isn't refilled while any
+// reference to it is alive; taking and dropping one is a single atomic add.
+class snapshot_ref_t
+{
+public:
+    snapshot_ref_t() = default;
+    // Takes over a reference already counted in the slot
+    explicit snapshot_ref_t(snapshot_slot_t *slot) : slot(slot) {}
+
+    snapshot_ref_t(const snapshot_ref_t &other) : slot(other.slot)
+    {
+        if (slot != nullptr) {
+            slot->references.fetch_add(1);
+        }
+    }
+    snapshot_ref_t(snapshot_ref_t &&other) noexcept : slot(other.slot) { other.slot = nullptr; }
+    snapshot_ref_t &operator=(snapshot_ref_t other) noexcept
+    {
+        std::swap(slot, other.slot);
+        return *this;
+    }
+    ~snapshot_ref_t()
+    {
+        if (slot != nullptr) {
+            slot->references.fetch_sub(1);
+        }
+    }
+
+    explicit operator bool() const { return slot != nullptr; }
+    const grid_snapshot_t &operator*() const { return slot->snapshot; }
+    const grid_snapshot_t *operator->() const { return &slot->snapshot; }
+
+private:
+    snapshot_slot_t *slot = nullptr;
+};
+
+// Copies the current state into a free slot, makes it the latest snapshot and
+// returns it. Called with the engine to itself (simulation_mutex in the server),
+// after the iterations it wants readers to see. It only waits if readers hold
+// every other slot.
+snapshot_ref_t publish_snapshot();
+
+// The snapshot last published. Lock-free: the reader counts itself in the latest
+// slot and checks that it's still the latest, retrying only when a publication
+// got in between. Holds an empty grid until the first publish_snapshot.
+snapshot_ref_t latest_snapshot();
+
+// Entry points used by ecosim-bench to time single parts of an iteration on the
+// current grid. They don't change the simulation.
+
+// Scans the neighbourhood of every live entity for empty cells and prey, the
+// first step of every kernel, and returns the number of cells found
+uint64_t scan_live_neighbourhoods();
+
+// Makes count keyed random draws (decision and target, as the kernels do) for
+// the live entities in turn and returns a checksum of the outcomes
+uint64_t draw_random_actions(uint64_t count);
+
+// Conditions that end a run_until. Zero disables a budget; the steady state
+// check is disabled while steady_ticks is zero.
+struct stop_conditions_t
+{
+    bool extinction = true;     // a species alive when the run started dies out
+    double steady_epsilon = 0;  // total population within this fraction of the window's first tick...
+    uint32_t steady_ticks = 0;  // ...for this many ticks in a row
+    uint64_t max_ticks = 0;
+    double max_seconds = 0;
+};
+
+enum stop_reason_t
+{
+    stop_none,
+    stop_extinction,
+    stop_steady_state,
+    stop_max_ticks,
+    stop_wall_clock
+};
+
+const char *stop_reason_name(stop_reason_t reason);
+
+// Population of one species over the ticks of a run
+struct species_summary_t
+{
+    uint32_t minimum;
+    uint32_t maximum;
+    uint64_t sum;
+};
+
+// Follows a run tick by tick, collecting the population statistics and
+// checking the stop conditions. Created right before the first tick.
+struct run_monitor_t
+{
+    stop_conditions_t conditions;
+    std::chrono::steady_clock::time_point start;
+    uint64_t ticks = 0;
+    species_summary_t species[4]; // indexed by entity_type_t
+    bool alive_at_start[4];
+    entity_type_t extinct_species = empty;
+    uint64_t steady_reference = 0;
+    uint32_t steady_count = 0;
+
+    explicit run_monitor_t(const stop_conditions_t &conditions);
+
+    // Records the tick just computed and returns why the run must stop, or stop_none
+    stop_reason_t observe();
+
+    double seconds() const;
+};
+
+// Advances the simulation until one of the stop conditions holds. The caller
+// must set a budget unless it's sure a population condition will be met.
+stop_reason_t run_until(worker_pool &workers, run_monitor_t &monitor);
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef ECOSIM_WORKER_POOL_H
+#define ECOSIM_WORKER_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Load counters of one worker since the pool was created
+struct worker_stats_t
+{
+    uint64_t busy_ns;  // time spent running tasks
+    uint64_t tasks;    // tasks run, including stolen ones
+    uint64_t steals;   // tasks taken from another worker's queue
+    double utilization; // busy time over the time the pool spent in parallel_for
+};
+
+// Where the time of the pool's parallel_for calls went, added up since the pool
+// was created
+struct pool_timing_t
+{
+    uint64_t dispatch_ns; // queueing the tasks and waking the workers up
+    uint64_t run_ns;      // until the first worker ran out of tasks
+    uint64_t join_ns;     // waiting for the last worker to finish after that
+};
+
+// Long-lived pool of worker threads, created once at startup and reused by every
+// iteration of the simulation instead of spawning one thread per entity.
+//
+// parallel_for cuts the range into small tasks and deals them out in contiguous
+// runs to per-worker deques. A worker pops from the front of its own deque and,
+// once it's empty, steals from the back of the others', so regions with many
+// entities get shared among the workers instead of leaving the rest idle.
+class worker_pool
+{
+public:
+    // Function executed by a worker over one task: (worker id, begin, end)
+    using batch_job_t = std::function<void(size_t, size_t, size_t)>;
+
+    // Number of tasks each worker gets when the range is dealt out
+    static const size_t TASKS_PER_WORKER = 8;
+
+    explicit worker_pool(size_t num_workers) : queues(std::max<size_t>(1, num_workers)), counters(queues.size())
+    {
+        for (size_t w = 0; w < queues.size(); w++) {
+            workers.emplace_back(&worker_pool::worker_loop, this, w);
+        }
+    }
+
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    worker_pool(const worker_pool &) = delete;
+    worker_pool &operator=(const worker_pool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // Runs job over [0, count) and blocks until every task has been processed.
+    // grain is the number of items per task, 0 picks one that gives each worker
+    // TASKS_PER_WORKER tasks. Concurrent callers are serialized.
+    void parallel_for(size_t count, const batch_job_t &job, size_t grain = 0)
+    {
+        if (count == 0) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+        auto start = std::chrono::steady_clock::now();
+
+        std::chrono::steady_clock::time_point woken;
+        if (grain == 0) {
+            grain = std::max<size_t>(1, count / (size() * TASKS_PER_WORKER));
+        }
+        size_t num_tasks = (count + grain - 1) / grain;
+        for (size_t t = 0; t < num_tasks; t++) {
+            worker_queue_t &queue = queues[t * size() / num_tasks];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.emplace_back(t * grain, std::min(count, (t + 1) * grain));
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            current_job = &job;
+            pending_workers = size();
+            generation++;
+            work_cv.notify_all();
+            woken = std::chrono::steady_clock::now();
+            done_cv.wait(lock, [this] { return pending_workers == 0; });
+            current_job = nullptr;
+        }
+
+        auto done = std::chrono::steady_clock::now();
+        first_idle = std::max(first_idle, woken);
+        parallel_ns += elapsed_ns(start, done);
+        dispatch_ns += elapsed_ns(start, woken);
+        run_ns += elapsed_ns(woken, first_idle);
+        join_ns += elapsed_ns(first_idle, done);
+    }
+
+    pool_timing_t timing() const
+    {
+        return {dispatch_ns.load(std::memory_order_relaxed), run_ns.load(std::memory_order_relaxed),
+                join_ns.load(std::memory_order_relaxed)};
+    }
+
+    std::vector<worker_stats_t> stats() const
+    {
+        std::vector<worker_stats_t> result;
+        uint64_t total_ns = parallel_ns.load(std::memory_order_relaxed);
+        for (const worker_counters_t &counter : counters) {
+            worker_stats_t worker;
+            worker.busy_ns = counter.busy_ns.load(std::memory_order_relaxed);
+            worker.tasks = counter.tasks.load(std::memory_order_relaxed);
+            worker.steals = counter.steals.load(std::memory_order_relaxed);
+            worker.utilization = total_ns > 0 ? (double)worker.busy_ns / total_ns : 0.0;
+            result.push_back(worker);
+        }
+        return result;
+    }
+
+private:
+    using task_t = std::pair<size_t, size_t>;
+
+    static uint64_t elapsed_ns(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+    }
+
+    struct alignas(64) worker_queue_t
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    struct alignas(64) worker_counters_t
+    {
+        std::atomic<uint64_t> busy_ns{0};
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> steals{0};
+    };
+
+    bool pop_task(size_t worker_id, task_t &task)
+    {
+        worker_queue_t &queue = queues[worker_id];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+    }
+
+    bool steal_task(size_t worker_id, task_t &task)
+    {
+        for (size_t k = 1; k < queues.size(); k++) {
+            worker_queue_t &victim = queues[(worker_id + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(size_t worker_id)
+    {
+        worker_counters_t &counter = counters[worker_id];
+        size_t seen_generation = 0;
+        while (true) {
+            const batch_job_t *job;
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                work_cv.wait(lock, [&] { return stopping || generation != seen_generation; });
+                if (stopping) {
+                    return;
+                }
+                seen_generation = generation;
+                job = current_job;
+            }
+
+            // Every task is queued before the workers are woken up, so once all
+            // the queues are empty this worker has nothing left to do
+            task_t task;
+            while (true) {
+                bool stolen = false;
+                if (!pop_task(worker_id, task)) {
+                    if (!steal_task(worker_id, task)) {
+                        break;
+                    }
+                    stolen = true;
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                (*job)(worker_id, task.first, task.second);
+                counter.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                counter.tasks++;
+                if (stolen) {
+                    counter.steals++;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            if (pending_workers == size()) {
+                first_idle = std::chrono::steady_clock::now();
+            }
+            if (--pending_workers == 0) {
+                done_cv.notify_one();
+            }
+        }
+    }
+
+    std::vector<worker_queue_t> queues;
+    std::vector<worker_counters_t> counters;
+    std::vector<std::thread> workers;
+    std::atomic<uint64_t> parallel_ns{0};
+    std::atomic<uint64_t> dispatch_ns{0};
+    std::atomic<uint64_t> run_ns{0};
+    std::atomic<uint64_t> join_ns{0};
+    std::chrono::steady_clock::time_point first_idle; // guarded by pool_mutex
+    std::mutex run_mutex;
+    std::mutex pool_mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    const batch_job_t *current_job = nullptr;
+    size_t pending_workers = 0;
+    size_t generation = 0;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,126 @@
+// Checks of the simulation engine run by ctest: seeded runs that must not depend
+// on the number of workers, the incrementally kept population totals and the
+// delta history of the snapshots. Exits with a non-zero status on the first
+// failed check.
+#include "simulation.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static void check(bool condition, const char *what, tick_mode_t mode) {
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s (mode %s)\n", what, TICK_MODE_NAMES[mode].first);
+        exit(1);
+    }
+}
+
+static simulation_config_t test_config(tick_mode_t mode) {
+    simulation_config_t config;
+    config.rows = 60;
+    config.cols = 60;
+    config.mode = mode;
+    config.seed = 20240607;
+    config.plants = 900;
+    config.herbivores = 300;
+    config.carnivores = 50;
+    return config;
+}
+
+static bool same_grid(const entity_grid_t &a, const entity_grid_t &b) {
+    return a.type == b.type && a.energy == b.energy && a.age == b.age;
+}
+
+static entity_grid_t run_seeded(tick_mode_t mode, size_t num_workers, uint32_t ticks) {
+    worker_pool workers(num_workers);
+    start_simulation(test_config(mode));
+    for (uint32_t tick = 0; tick < ticks; tick++) {
+        next_iteration(workers);
+    }
+    return entity_grid;
+}
+
+// The modes documented as deterministic give the same grid for any number of workers
+static void test_worker_count_determinism() {
+    for (tick_mode_t mode : {tick_checkerboard, tick_double_buffered}) {
+        entity_grid_t single = run_seeded(mode, 1, 80);
+        check(same_grid(single, run_seeded(mode, 4, 80)), "1 and 4 workers give the same grid", mode);
+        check(same_grid(single, run_seeded(mode, 3, 80)), "1 and 3 workers give the same grid", mode);
+    }
+}
+
+// population() and population_stats() match a recount of the grid after every tick
+static void test_population_stats() {
+    for (const auto &entry : TICK_MODE_NAMES) {
+        worker_pool workers(3);
+        start_simulation(test_config(entry.second));
+        for (uint32_t tick = 0; tick <= 50; tick++) {
+            population_stats_t expected;
+            uint32_t counts[4] = {};
+            for (uint32_t idx = 0; idx < entity_grid.size(); idx++) {
+                entity_type_t type = entity_grid.type[idx];
+                counts[type]++;
+                expected.energy[type] += entity_grid.energy[idx];
+                expected.age_histogram[type][std::min<uint32_t>(entity_grid.age[idx] / AGE_BUCKET_WIDTH, NUM_AGE_BUCKETS - 1)]++;
+            }
+
+            const population_stats_t &stats = population_stats();
+            for (entity_type_t type : {plant, herbivore, carnivore}) {
+                check(population(type) == counts[type], "population matches a recount", entry.second);
+                check(stats.energy[type] == expected.energy[type], "total energy matches a recount", entry.second);
+                for (uint32_t bucket = 0; bucket < NUM_AGE_BUCKETS; bucket++) {
+                    check(stats.age_histogram[type][bucket] == expected.age_histogram[type][bucket], "age histogram matches a recount", entry.second);
+                }
+            }
+            next_iteration(workers);
+        }
+    }
+}
+
+// Replaying the cells a snapshot reports as changed since an older one onto the
+// older grid gives the newer grid, for every base still in the history
+static void test_delta_replay() {
+    for (const auto &entry : TICK_MODE_NAMES) {
+        worker_pool workers(2);
+        start_simulation(test_config(entry.second));
+        // Only copies of the older grids are kept, holding every snapshot would
+        // pin more slots than there are
+        std::vector<grid_snapshot_t> published;
+        published.push_back(*publish_snapshot());
+        snapshot_ref_t latest_ref;
+        for (uint32_t tick = 1; tick <= DELTA_HISTORY_TICKS + 10; tick++) {
+            next_iteration(workers);
+            // Some iterations aren't published, like the steps of a multi-step request
+            if (tick % 3 != 0) {
+                latest_ref = publish_snapshot();
+                published.push_back(*latest_ref);
+            }
+        }
+
+        const grid_snapshot_t &latest = *latest_ref;
+        check(same_grid(latest.grid, entity_grid), "the latest snapshot holds the current grid", entry.second);
+        std::vector<uint32_t> cells;
+        for (const grid_snapshot_t &base : published) {
+            bool in_history = latest.tick - base.tick <= DELTA_HISTORY_TICKS;
+            check(latest.cells_changed_since(base.run, base.tick, cells) == in_history, "delta available exactly within the history", entry.second);
+            if (!in_history) {
+                continue;
+            }
+            entity_grid_t replayed = base.grid;
+            for (uint32_t idx : cells) {
+                replayed.set(idx, latest.grid.type[idx], latest.grid.energy[idx], latest.grid.age[idx]);
+            }
+            check(same_grid(replayed, latest.grid), "replayed delta gives the snapshot grid", entry.second);
+        }
+        check(!latest.cells_changed_since(latest.run - 1, latest.tick, cells), "no delta from another run", entry.second);
+    }
+}
+
+int main()
+{
+    test_worker_count_determinism();
+    test_population_stats();
+    test_delta_replay();
+    printf("all engine checks passed\n");
+    return 0;
+}